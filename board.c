@@ -11,6 +11,106 @@ static const int piece_value[6] = {
     300,  // Bishop
 };
 
+// Contribution of the pieces to the game phase, used to taper between the middlegame and the
+// endgame piece-square scores
+static const int phase_weight[6] = {0, 1, 2, 4, 1, 0};
+
+//
+// Piece-square tables from white's point of view, rank 8 first
+//
+
+static const int pawn_mg[64] = {
+    0,  0,  0,   0,   0,   0,   0,  0,   //
+    50, 50, 50,  50,  50,  50,  50, 50,  //
+    10, 10, 20,  30,  30,  20,  10, 10,  //
+    5,  5,  10,  25,  25,  10,  5,  5,   //
+    0,  0,  0,   20,  20,  0,   0,  0,   //
+    5,  -5, -10, 0,   0,   -10, -5, 5,   //
+    5,  10, 10,  -20, -20, 10,  10, 5,   //
+    0,  0,  0,   0,   0,   0,   0,  0,   //
+};
+
+static const int pawn_eg[64] = {
+    0,  0,  0,  0,  0,  0,  0,  0,   //
+    80, 80, 80, 80, 80, 80, 80, 80,  //
+    50, 50, 50, 50, 50, 50, 50, 50,  //
+    30, 30, 30, 30, 30, 30, 30, 30,  //
+    20, 20, 20, 20, 20, 20, 20, 20,  //
+    10, 10, 10, 10, 10, 10, 10, 10,  //
+    10, 10, 10, 10, 10, 10, 10, 10,  //
+    0,  0,  0,  0,  0,  0,  0,  0,   //
+};
+
+static const int knight_psq[64] = {
+    -50, -40, -30, -30, -30, -30, -40, -50,  //
+    -40, -20, 0,   0,   0,   0,   -20, -40,  //
+    -30, 0,   10,  15,  15,  10,  0,   -30,  //
+    -30, 5,   15,  20,  20,  15,  5,   -30,  //
+    -30, 0,   15,  20,  20,  15,  0,   -30,  //
+    -30, 5,   10,  15,  15,  10,  5,   -30,  //
+    -40, -20, 0,   5,   5,   0,   -20, -40,  //
+    -50, -40, -30, -30, -30, -30, -40, -50,  //
+};
+
+static const int bishop_psq[64] = {
+    -20, -10, -10, -10, -10, -10, -10, -20,  //
+    -10, 0,   0,   0,   0,   0,   0,   -10,  //
+    -10, 0,   5,   10,  10,  5,   0,   -10,  //
+    -10, 5,   5,   10,  10,  5,   5,   -10,  //
+    -10, 0,   10,  10,  10,  10,  0,   -10,  //
+    -10, 10,  10,  10,  10,  10,  10,  -10,  //
+    -10, 5,   0,   0,   0,   0,   5,   -10,  //
+    -20, -10, -10, -10, -10, -10, -10, -20,  //
+};
+
+static const int rook_psq[64] = {
+    0,  0,  0,  0,  0,  0,  0,  0,   //
+    5,  10, 10, 10, 10, 10, 10, 5,   //
+    -5, 0,  0,  0,  0,  0,  0,  -5,  //
+    -5, 0,  0,  0,  0,  0,  0,  -5,  //
+    -5, 0,  0,  0,  0,  0,  0,  -5,  //
+    -5, 0,  0,  0,  0,  0,  0,  -5,  //
+    -5, 0,  0,  0,  0,  0,  0,  -5,  //
+    0,  0,  0,  5,  5,  0,  0,  0,   //
+};
+
+static const int queen_psq[64] = {
+    -20, -10, -10, -5, -5, -10, -10, -20,  //
+    -10, 0,   0,   0,  0,  0,   0,   -10,  //
+    -10, 0,   5,   5,  5,  5,   0,   -10,  //
+    -5,  0,   5,   5,  5,  5,   0,   -5,   //
+    0,   0,   5,   5,  5,  5,   0,   -5,   //
+    -10, 5,   5,   5,  5,  5,   0,   -10,  //
+    -10, 0,   5,   0,  0,  0,   0,   -10,  //
+    -20, -10, -10, -5, -5, -10, -10, -20,  //
+};
+
+static const int king_mg[64] = {
+    -30, -40, -40, -50, -50, -40, -40, -30,  //
+    -30, -40, -40, -50, -50, -40, -40, -30,  //
+    -30, -40, -40, -50, -50, -40, -40, -30,  //
+    -30, -40, -40, -50, -50, -40, -40, -30,  //
+    -20, -30, -30, -40, -40, -30, -30, -20,  //
+    -10, -20, -20, -20, -20, -20, -20, -10,  //
+    20,  20,  0,   0,   0,   0,   20,  20,   //
+    20,  30,  10,  0,   0,   10,  30,  20,   //
+};
+
+static const int king_eg[64] = {
+    -50, -40, -30, -20, -20, -30, -40, -50,  //
+    -30, -20, -10, 0,   0,   -10, -20, -30,  //
+    -30, -10, 20,  30,  30,  20,  -10, -30,  //
+    -30, -10, 30,  40,  40,  30,  -10, -30,  //
+    -30, -10, 30,  40,  40,  30,  -10, -30,  //
+    -30, -10, 20,  30,  30,  20,  -10, -30,  //
+    -30, -30, 0,   0,   0,   0,   -30, -30,  //
+    -50, -30, -30, -30, -30, -30, -30, -50,  //
+};
+
+// Indexed by piece type
+static const int *const psq_mg[6] = {pawn_mg, knight_psq, rook_psq, queen_psq, bishop_psq, king_mg};
+static const int *const psq_eg[6] = {pawn_eg, knight_psq, rook_psq, queen_psq, bishop_psq, king_eg};
+
 int PieceToHashIndex(int piece, int player)
 {
   if (player == BLACK)
@@ -19,26 +119,7 @@ int PieceToHashIndex(int piece, int player)
     return piece;
 }
 
-static int popcnt(BB b)
-{
-  int sq;
-  int i = 0;
-  while ((sq = ffsll((long long)b)) != 0)
-  {
-    i++;
-    b &= ~SQ_TO_BB(sq - 1);
-  };
-  return i;
-}
-
-int GetTotalMaterial(Board *b, int side)
-{
-  int total = 0;
-
-  for (int i = 0; i < 5; i++) total += popcnt(b->piece[side][i]) * piece_value[i];
-
-  return total;
-}
+int GetTotalMaterial(Board *b, int side) { return b->eval.material[side]; }
 
 int IsEndgmae(Board *b)
 {
@@ -48,8 +129,8 @@ int IsEndgmae(Board *b)
   // Max 3 pieces other than pawns and kings
   for (int i = 1; i < 5; i++)
   {
-    total_w += popcnt(b->piece[WHITE][i]);
-    total_b += popcnt(b->piece[BLACK][i]);
+    total_w += POPCOUNT(b->piece[WHITE][i]);
+    total_b += POPCOUNT(b->piece[BLACK][i]);
   }
 
   return total_w <= 3 && total_b <= 3;
@@ -72,22 +153,115 @@ int SquareAttackedBy(Board *b, int side, int sq)
   if ((precomp_knight_moves[sq] & b->piece[side][KNIGHT]) != 0) return 1;
   if ((precomp_king_moves[sq] & b->piece[side][KING]) != 0) return 1;
 
-  BB rook_blocker = precomp_rook_blocker_mask[sq] & b->all_pieces;
-  if ((precomp_rook_moves[sq][(rook_blocker * precomp_rook_magic[sq]) >> (64 - 12)] &
-       (b->piece[side][ROOK] | b->piece[side][QUEEN])) != 0)
+  if ((ROOK_ATTACKS(sq, b->all_pieces) & (b->piece[side][ROOK] | b->piece[side][QUEEN])) != 0)
     return 1;
-
-  BB bishop_blocker = precomp_bishop_blocker_mask[sq] & b->all_pieces;
-  if ((precomp_bishop_moves[sq][(bishop_blocker * precomp_bishop_magic[sq]) >> (64 - 9)] &
-       (b->piece[side][QUEEN] | b->piece[side][BISHOP])) != 0)
+  if ((BISHOP_ATTACKS(sq, b->all_pieces) & (b->piece[side][QUEEN] | b->piece[side][BISHOP])) != 0)
     return 1;
 
   return 0;
 }
 
+// Returns all pieces of the side attacking the square, with sliders blocked by the given occupancy
+BB AttackersTo(Board *b, int side, int sq, BB occupancy)
+{
+  BB sq_bb     = SQ_TO_BB(sq);
+  BB attackers = 0;
+
+  if (side == WHITE)
+    attackers |= (((sq_bb & ~FILE_H) >> 7) | ((sq_bb & ~FILE_A) >> 9)) & b->piece[side][PAWN];
+  else
+    attackers |= (((sq_bb & ~FILE_H) << 9) | ((sq_bb & ~FILE_A) << 7)) & b->piece[side][PAWN];
+
+  attackers |= precomp_knight_moves[sq] & b->piece[side][KNIGHT];
+  attackers |= precomp_king_moves[sq] & b->piece[side][KING];
+  attackers |= ROOK_ATTACKS(sq, occupancy) & (b->piece[side][ROOK] | b->piece[side][QUEEN]);
+  attackers |= BISHOP_ATTACKS(sq, occupancy) & (b->piece[side][QUEEN] | b->piece[side][BISHOP]);
+
+  return attackers;
+}
+
+// Static exchange evaluation: the material won by the side to move after the captures on the
+// destination of the move, both sides capture with their least valuable piece and can stop
+// whenever continuing would lose material. Sliders behind the capturing pieces join in.
+int SEE(Board *b, Move m)
+{
+  const int order[6] = {PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING};
+
+  int gain[32];
+  int depth = 0;
+
+  int type = GET_TYPE(m);
+  if (type == MOVE_TYPE_CASTLE_K || type == MOVE_TYPE_CASTLE_Q) return 0;
+
+  int dest  = GET_DEST_SQ(m);
+  int side  = b->turn;
+  int piece = GET_PIECE(m);  // The piece standing on the destination
+
+  BB occupancy = b->all_pieces & ~SQ_TO_BB(GET_ORIGIN_SQ(m));
+
+  gain[0] = b->mailbox[dest] != PIECE_NONE ? piece_value[b->mailbox[dest]] : 0;
+
+  if (type == MOVE_TYPE_EP)
+  {
+    gain[0] = piece_value[PAWN];
+    occupancy &= ~SQ_TO_BB(dest ^ 8);
+  }
+  else if (type == MOVE_TYPE_PROMOTION || type == MOVE_TYPE_PROMOTION_WITH_CAPTURE)
+  {
+    piece = GET_PROMOTION_PIECE(m);
+    gain[0] += piece_value[piece] - piece_value[PAWN];
+  }
+
+  BB straight = b->piece[WHITE][ROOK] | b->piece[WHITE][QUEEN] | b->piece[BLACK][ROOK] |
+                b->piece[BLACK][QUEEN];
+  BB diagonal = b->piece[WHITE][BISHOP] | b->piece[WHITE][QUEEN] | b->piece[BLACK][BISHOP] |
+                b->piece[BLACK][QUEEN];
+
+  BB attackers =
+      (AttackersTo(b, WHITE, dest, occupancy) | AttackersTo(b, BLACK, dest, occupancy)) & occupancy;
+
+  while (depth < 31)
+  {
+    side = !side;
+
+    BB side_attackers = attackers & b->pieces_of[side];
+    if (side_attackers == 0) break;
+
+    int i;
+    BB  from = 0;
+    for (i = 0; i < 6; i++)
+      if ((from = side_attackers & b->piece[side][order[i]]) != 0) break;
+
+    // The king can't capture a defended piece
+    if (order[i] == KING && (attackers & b->pieces_of[!side]) != 0) break;
+
+    depth++;
+    gain[depth] = piece_value[piece] - gain[depth - 1];
+    piece       = order[i];
+
+    occupancy &= ~(from & -from);
+    attackers |= (ROOK_ATTACKS(dest, occupancy) & straight) |
+                 (BISHOP_ATTACKS(dest, occupancy) & diagonal);
+    attackers &= occupancy;
+  }
+
+  for (; depth > 0; depth--)
+    if (gain[depth] > -gain[depth - 1]) gain[depth - 1] = -gain[depth];
+
+  return gain[0];
+}
+
 int IsKingAttacked(Board *b, int side)
 {
-  return SquareAttackedBy(b, !side, ffsll((long long)b->piece[side][KING]) - 1);
+  return SquareAttackedBy(b, !side, BB_TO_SQ(b->piece[side][KING]));
+}
+
+// Boards are set up without a stack, it's needed only to make moves. The stack is emptied, the
+// board's current position becomes the root.
+void SetUndoStack(Board *b, UndoStack *undo)
+{
+  b->undo     = undo;
+  undo->count = 0;
 }
 
 int IsLegal(Board *b, Move m)
@@ -108,24 +282,129 @@ void updateBitboards(Board *b)
     for (int j = 0; j < 6; j++) b->pieces_of[i] |= b->piece[i][j];
 
   b->all_pieces = b->pieces_of[WHITE] | b->pieces_of[BLACK];
+}
+
+static void updateMailbox(Board *b)
+{
+  memset(b->mailbox, PIECE_NONE, sizeof(b->mailbox));
+
+  for (int i = 0; i < 2; i++)
+  {
+    for (int j = 0; j < 6; j++)
+    {
+      BB pieces = b->piece[i][j];
+      int sq;
+
+      while (pieces != 0)
+      {
+        sq = LSB(pieces);
+        b->mailbox[sq] = j;
+        POP_LSB(pieces);
+      }
+    }
+  }
+}
+
+static BB castleHash(unsigned char castle[2])
+{
+  BB hash = 0;
+
+  for (int i = 0; i < 2; i++)
+  {
+    if (castle[i] & CASTLE_K) hash ^= precomp_hash_castle[i][CASTLE_K - 1];
+    if (castle[i] & CASTLE_Q) hash ^= precomp_hash_castle[i][CASTLE_Q - 1];
+  }
+
+  return hash;
+}
+
+// The tables are written from white's side with rank 8 first
+static int psqIndex(int side, int sq) { return side == WHITE ? FLIP_SQ(sq) : sq; }
+
+static void evalAddPiece(Board *b, int side, int piece, int sq)
+{
+  int sign = side == WHITE ? 1 : -1;
+
+  b->eval.material[side] += piece_value[piece];
+  b->eval.phase += phase_weight[piece];
+  b->eval.psq_mg += sign * psq_mg[piece][psqIndex(side, sq)];
+  b->eval.psq_eg += sign * psq_eg[piece][psqIndex(side, sq)];
+}
+
+static void evalRemovePiece(Board *b, int side, int piece, int sq)
+{
+  int sign = side == WHITE ? 1 : -1;
+
+  b->eval.material[side] -= piece_value[piece];
+  b->eval.phase -= phase_weight[piece];
+  b->eval.psq_mg -= sign * psq_mg[piece][psqIndex(side, sq)];
+  b->eval.psq_eg -= sign * psq_eg[piece][psqIndex(side, sq)];
+}
+
+static void evalMovePiece(Board *b, int side, int piece, int origin, int dest)
+{
+  int sign = side == WHITE ? 1 : -1;
+
+  b->eval.psq_mg +=
+      sign * (psq_mg[piece][psqIndex(side, dest)] - psq_mg[piece][psqIndex(side, origin)]);
+  b->eval.psq_eg +=
+      sign * (psq_eg[piece][psqIndex(side, dest)] - psq_eg[piece][psqIndex(side, origin)]);
+}
+
+// Full recomputation, used only when the position is set up from scratch
+static void computeEval(Board *b)
+{
+  memset(&b->eval, 0, sizeof(EvalTerms));
+
+  for (int sq = 0; sq < 64; sq++)
+  {
+    if (b->mailbox[sq] == PIECE_NONE) continue;
+
+    int side = (b->pieces_of[WHITE] & SQ_TO_BB(sq)) != 0 ? WHITE : BLACK;
+    evalAddPiece(b, side, b->mailbox[sq], sq);
+  }
+}
+
+// Full hash recomputation, used only when the position is set up from scratch
+// (MakeMove/UnmakeMove update the hash incrementally)
+static BB computeHash(Board *b)
+{
+  BB hash = 0;
 
-  b->hash_value = 0;
   for (int i = 0; i < 2; i++)
   {
     for (int j = 0; j < 64; j++)
     {
       BB sq_bb = SQ_TO_BB(j);
       if ((sq_bb & b->pieces_of[i]) != 0)
-        b->hash_value ^= precomp_hash[j][PieceToHashIndex(GetPieceAt(b, sq_bb), i)];
+        hash ^= precomp_hash[j][PieceToHashIndex(b->mailbox[j], i)];
     }
-
-    if (b->castle[i] & CASTLE_K) b->hash_value ^= precomp_hash_castle[i][CASTLE_K - 1];
-    if (b->castle[i] & CASTLE_Q) b->hash_value ^= precomp_hash_castle[i][CASTLE_Q - 1];
   }
 
-  b->hash_value ^= precomp_hash_turn[b->turn];
+  hash ^= castleHash(b->castle);
+  hash ^= precomp_hash_turn[b->turn];
 
-  if (b->ep_possible) b->hash_value ^= precomp_hash_ep[ffsll((long long)b->ep_square) - 1];
+  if (b->ep_possible) hash ^= precomp_hash_ep[BB_TO_SQ(b->ep_square)];
+
+  return hash;
+}
+
+static BB computePawnHash(Board *b)
+{
+  BB hash = 0;
+
+  for (int i = 0; i < 2; i++)
+  {
+    BB pawns = b->piece[i][PAWN];
+
+    while (pawns != 0)
+    {
+      hash ^= precomp_hash[LSB(pawns)][PieceToHashIndex(PAWN, i)];
+      POP_LSB(pawns);
+    }
+  }
+
+  return hash;
 }
 
 void Startpos(Board *b)
@@ -157,9 +436,14 @@ void Startpos(Board *b)
 
   b->ep_possible = 0;
 
-  b->variation.plies_count = 0;
+  b->undo = NULL;
 
   updateBitboards(b);
+  updateMailbox(b);
+  computeEval(b);
+  b->hash_value = computeHash(b);
+  b->pawn_hash  = computePawnHash(b);
+  NNUERefresh(b);
 }
 
 void FEN(Board *b, char *str)
@@ -267,16 +551,23 @@ void FEN(Board *b, char *str)
   str += 2;
 
   updateBitboards(b);
+  updateMailbox(b);
+  computeEval(b);
+  b->hash_value = computeHash(b);
+  b->pawn_hash  = computePawnHash(b);
+  NNUERefresh(b);
 }
 
 int GetPieceAt(Board *b, BB s)
 {
-  for (int i = 0; i < 6; i++)
-    for (int j = 0; j < 2; j++)
-      if ((s & b->piece[j][i]) == s) return i;
+  int piece = b->mailbox[BB_TO_SQ(s)];
 
-  printf("GetPieceAt - empty square\n");
-  return 0;
+  if (piece == PIECE_NONE)
+  {
+    printf("GetPieceAt - empty square\n");
+    return 0;
+  }
+  return piece;
 }
 
 void PrintMoveStr(char buff[], Move m)
@@ -315,6 +606,25 @@ void PrintMoveStr(char buff[], Move m)
   }
 }
 
+// Castles are written as king moves and the null move as 0000, as UCI expects
+void PrintMoveUCI(char buff[], Move m, int side)
+{
+  const int king_sq[2] = {4, 60};
+
+  if (m == NULL_MOVE)
+  {
+    sprintf(buff, "0000");
+    return;
+  }
+
+  if (GET_TYPE(m) == MOVE_TYPE_CASTLE_K)
+    m = CREATE_MOVE(king_sq[side], king_sq[side] + 2, 0, 0, KING, MOVE_TYPE_SILENT);
+  else if (GET_TYPE(m) == MOVE_TYPE_CASTLE_Q)
+    m = CREATE_MOVE(king_sq[side], king_sq[side] - 2, 0, 0, KING, MOVE_TYPE_SILENT);
+
+  PrintMoveStr(buff, m);
+}
+
 void PrintBoard(Board *b)
 {
   const char piece_char[2][6] = {
@@ -330,9 +640,9 @@ void PrintBoard(Board *b)
       BB  sq_bb = SQ_TO_BB(sq);
 
       if ((sq_bb & b->pieces_of[WHITE]) != 0)
-        putchar(piece_char[WHITE][GetPieceAt(b, sq_bb)]);
+        putchar(piece_char[WHITE][b->mailbox[sq]]);
       else if ((sq_bb & b->pieces_of[BLACK]) != 0)
-        putchar(piece_char[BLACK][GetPieceAt(b, sq_bb)]);
+        putchar(piece_char[BLACK][b->mailbox[sq]]);
       else
         putchar('.');
 
@@ -343,8 +653,8 @@ void PrintBoard(Board *b)
   if (b->ep_possible)
     printf(
         "Ep square: %c%c\n",
-        (ffsll((long long)b->ep_square) - 1) % 8 + 'a',
-        (ffsll((long long)b->ep_square) - 1) / 8 + '1'
+        (BB_TO_SQ(b->ep_square)) % 8 + 'a',
+        (BB_TO_SQ(b->ep_square)) / 8 + '1'
     );
 }
 
@@ -371,15 +681,24 @@ static void updateCastlingAfterCapture(Board *b, BB dest_bb)
 
 void MakeMove(Board *b, Move m)
 {
-  b->variation.plies[b->variation.plies_count]            = m;
-  b->state_backup[b->variation.plies_count].ep_possible   = b->ep_possible;
-  b->state_backup[b->variation.plies_count].ep_square     = b->ep_square;
-  b->state_backup[b->variation.plies_count].castle[WHITE] = b->castle[WHITE];
-  b->state_backup[b->variation.plies_count].castle[BLACK] = b->castle[BLACK];
-  b->state_backup[b->variation.plies_count].halfmove      = b->halfmove;
-  b->state_backup[b->variation.plies_count].hash_value    = b->hash_value;
-
-  b->variation.plies_count++;
+  UndoRecord *undo = &b->undo->records[b->undo->count++];
+
+  undo->move = m;
+#ifdef COPY_MAKE
+  memcpy(undo->position, b, POSITION_SIZE);
+  if (nnue_loaded) undo->nnue = b->nnue;
+#else
+  undo->hash_value = b->hash_value;
+  undo->pawn_hash  = b->pawn_hash;
+  undo->eval       = b->eval;
+  undo->halfmove   = b->halfmove;
+  undo->castle     = b->castle[WHITE] | (b->castle[BLACK] << 2);
+  undo->ep_square  = b->ep_possible ? BB_TO_SQ(b->ep_square) : NO_EP_SQUARE;
+#endif
+
+  // Remove old castling rights and ep square from the hash, they are added back after the move
+  b->hash_value ^= castleHash(b->castle);
+  if (b->ep_possible) b->hash_value ^= precomp_hash_ep[BB_TO_SQ(b->ep_square)];
 
   if (m != NULL_MOVE)
   {
@@ -387,8 +706,14 @@ void MakeMove(Board *b, Move m)
 
     int piece = GET_PIECE(m);
 
-    BB origin_bb = SQ_TO_BB(GET_ORIGIN_SQ(m));
-    BB dest_bb   = SQ_TO_BB(GET_DEST_SQ(m));
+    int origin = GET_ORIGIN_SQ(m);
+    int dest   = GET_DEST_SQ(m);
+
+    BB origin_bb = SQ_TO_BB(origin);
+    BB dest_bb   = SQ_TO_BB(dest);
+
+    int us   = PieceToHashIndex(0, b->turn);
+    int them = PieceToHashIndex(0, !b->turn);
 
     if (piece == KING)
       b->castle[b->turn] = 0;
@@ -423,30 +748,79 @@ void MakeMove(Board *b, Move m)
     {
       case MOVE_TYPE_SILENT:
         b->piece[b->turn][piece] ^= (origin_bb | dest_bb);
+        b->mailbox[origin] = PIECE_NONE;
+        b->mailbox[dest]   = piece;
+        b->hash_value ^= precomp_hash[origin][us + piece] ^ precomp_hash[dest][us + piece];
+        if (piece == PAWN)
+          b->pawn_hash ^= precomp_hash[origin][us + PAWN] ^ precomp_hash[dest][us + PAWN];
+        evalMovePiece(b, b->turn, piece, origin, dest);
         break;
       case MOVE_TYPE_DOUBLE_PUSH:
         b->piece[b->turn][piece] ^= (origin_bb | dest_bb);
         b->ep_possible = 1;
         b->ep_square   = b->turn == WHITE ? (dest_bb >> 8) : (dest_bb << 8);
+        b->mailbox[origin] = PIECE_NONE;
+        b->mailbox[dest]   = piece;
+        b->hash_value ^= precomp_hash[origin][us + piece] ^ precomp_hash[dest][us + piece];
+        b->pawn_hash ^= precomp_hash[origin][us + PAWN] ^ precomp_hash[dest][us + PAWN];
+        evalMovePiece(b, b->turn, piece, origin, dest);
         break;
       case MOVE_TYPE_EP:
+      {
+        int captured_sq = b->turn == WHITE ? dest - 8 : dest + 8;
+
         b->piece[b->turn][piece] ^= (origin_bb | dest_bb);
-        b->piece[!b->turn][PAWN] &= ~(b->turn == WHITE ? (b->ep_square >> 8) : (b->ep_square << 8));
+        b->piece[!b->turn][PAWN] &= ~SQ_TO_BB(captured_sq);
+        b->mailbox[origin]      = PIECE_NONE;
+        b->mailbox[dest]        = piece;
+        b->mailbox[captured_sq] = PIECE_NONE;
+        b->hash_value ^= precomp_hash[origin][us + piece] ^ precomp_hash[dest][us + piece];
+        b->hash_value ^= precomp_hash[captured_sq][them + PAWN];
+        b->pawn_hash ^= precomp_hash[origin][us + PAWN] ^ precomp_hash[dest][us + PAWN];
+        b->pawn_hash ^= precomp_hash[captured_sq][them + PAWN];
+        evalMovePiece(b, b->turn, piece, origin, dest);
+        evalRemovePiece(b, !b->turn, PAWN, captured_sq);
         break;
+      }
       case MOVE_TYPE_CAPTURE:
         b->piece[b->turn][piece] ^= (origin_bb | dest_bb);
         b->piece[!b->turn][GET_CAPTURED_PIECE(m)] &= ~dest_bb;
         updateCastlingAfterCapture(b, dest_bb);
+        b->mailbox[origin] = PIECE_NONE;
+        b->mailbox[dest]   = piece;
+        b->hash_value ^= precomp_hash[origin][us + piece] ^ precomp_hash[dest][us + piece];
+        b->hash_value ^= precomp_hash[dest][them + GET_CAPTURED_PIECE(m)];
+        if (piece == PAWN)
+          b->pawn_hash ^= precomp_hash[origin][us + PAWN] ^ precomp_hash[dest][us + PAWN];
+        if (GET_CAPTURED_PIECE(m) == PAWN) b->pawn_hash ^= precomp_hash[dest][them + PAWN];
+        evalMovePiece(b, b->turn, piece, origin, dest);
+        evalRemovePiece(b, !b->turn, GET_CAPTURED_PIECE(m), dest);
         break;
       case MOVE_TYPE_PROMOTION:
         b->piece[b->turn][PAWN] &= ~origin_bb;
         b->piece[b->turn][GET_PROMOTION_PIECE(m)] |= dest_bb;
+        b->mailbox[origin] = PIECE_NONE;
+        b->mailbox[dest]   = GET_PROMOTION_PIECE(m);
+        b->hash_value ^= precomp_hash[origin][us + PAWN];
+        b->hash_value ^= precomp_hash[dest][us + GET_PROMOTION_PIECE(m)];
+        b->pawn_hash ^= precomp_hash[origin][us + PAWN];
+        evalRemovePiece(b, b->turn, PAWN, origin);
+        evalAddPiece(b, b->turn, GET_PROMOTION_PIECE(m), dest);
         break;
       case MOVE_TYPE_PROMOTION_WITH_CAPTURE:
         b->piece[b->turn][PAWN] &= ~origin_bb;
         b->piece[b->turn][GET_PROMOTION_PIECE(m)] |= dest_bb;
         b->piece[!b->turn][GET_CAPTURED_PIECE(m)] &= ~dest_bb;
         updateCastlingAfterCapture(b, dest_bb);
+        b->mailbox[origin] = PIECE_NONE;
+        b->mailbox[dest]   = GET_PROMOTION_PIECE(m);
+        b->hash_value ^= precomp_hash[origin][us + PAWN];
+        b->hash_value ^= precomp_hash[dest][us + GET_PROMOTION_PIECE(m)];
+        b->hash_value ^= precomp_hash[dest][them + GET_CAPTURED_PIECE(m)];
+        b->pawn_hash ^= precomp_hash[origin][us + PAWN];
+        evalRemovePiece(b, b->turn, PAWN, origin);
+        evalAddPiece(b, b->turn, GET_PROMOTION_PIECE(m), dest);
+        evalRemovePiece(b, !b->turn, GET_CAPTURED_PIECE(m), dest);
         break;
       case MOVE_TYPE_CASTLE_K:
         if (b->turn == WHITE)
@@ -454,12 +828,28 @@ void MakeMove(Board *b, Move m)
           b->piece[b->turn][KING] = 0x40;
           b->piece[b->turn][ROOK] ^= 0xa0;
           b->castle[WHITE] = 0;
+          b->hash_value ^= precomp_hash[4][us + KING] ^ precomp_hash[6][us + KING];
+          b->hash_value ^= precomp_hash[7][us + ROOK] ^ precomp_hash[5][us + ROOK];
+          b->mailbox[4] = PIECE_NONE;
+          b->mailbox[7] = PIECE_NONE;
+          b->mailbox[6] = KING;
+          b->mailbox[5] = ROOK;
+          evalMovePiece(b, b->turn, KING, 4, 6);
+          evalMovePiece(b, b->turn, ROOK, 7, 5);
         }
         else
         {
           b->piece[b->turn][KING] = 0x4000000000000000;
           b->piece[b->turn][ROOK] ^= 0xa000000000000000;
           b->castle[BLACK] = 0;
+          b->hash_value ^= precomp_hash[60][us + KING] ^ precomp_hash[62][us + KING];
+          b->hash_value ^= precomp_hash[63][us + ROOK] ^ precomp_hash[61][us + ROOK];
+          b->mailbox[60] = PIECE_NONE;
+          b->mailbox[63] = PIECE_NONE;
+          b->mailbox[62] = KING;
+          b->mailbox[61] = ROOK;
+          evalMovePiece(b, b->turn, KING, 60, 62);
+          evalMovePiece(b, b->turn, ROOK, 63, 61);
         }
         break;
       case MOVE_TYPE_CASTLE_Q:
@@ -468,12 +858,28 @@ void MakeMove(Board *b, Move m)
           b->piece[b->turn][KING] = 0x4;
           b->piece[b->turn][ROOK] ^= 0x9;
           b->castle[WHITE] = 0;
+          b->hash_value ^= precomp_hash[4][us + KING] ^ precomp_hash[2][us + KING];
+          b->hash_value ^= precomp_hash[0][us + ROOK] ^ precomp_hash[3][us + ROOK];
+          b->mailbox[4] = PIECE_NONE;
+          b->mailbox[0] = PIECE_NONE;
+          b->mailbox[2] = KING;
+          b->mailbox[3] = ROOK;
+          evalMovePiece(b, b->turn, KING, 4, 2);
+          evalMovePiece(b, b->turn, ROOK, 0, 3);
         }
         else
         {
           b->piece[b->turn][KING] = 0x400000000000000;
           b->piece[b->turn][ROOK] ^= 0x900000000000000;
           b->castle[BLACK] = 0;
+          b->hash_value ^= precomp_hash[60][us + KING] ^ precomp_hash[58][us + KING];
+          b->hash_value ^= precomp_hash[56][us + ROOK] ^ precomp_hash[59][us + ROOK];
+          b->mailbox[60] = PIECE_NONE;
+          b->mailbox[56] = PIECE_NONE;
+          b->mailbox[58] = KING;
+          b->mailbox[59] = ROOK;
+          evalMovePiece(b, b->turn, KING, 60, 58);
+          evalMovePiece(b, b->turn, ROOK, 56, 59);
         }
         break;
     }
@@ -481,68 +887,125 @@ void MakeMove(Board *b, Move m)
   else
     b->ep_possible = 0;
 
+  b->hash_value ^= castleHash(b->castle);
+  if (b->ep_possible) b->hash_value ^= precomp_hash_ep[BB_TO_SQ(b->ep_square)];
+  b->hash_value ^= precomp_hash_turn[WHITE] ^ precomp_hash_turn[BLACK];
+
   b->turn = !b->turn;
 
   updateBitboards(b);
+
+  if (nnue_loaded && m != NULL_MOVE) NNUEUpdate(b, m, !b->turn, 0);
+
+#ifdef DEBUG_HASH
+  if (b->hash_value != computeHash(b)) printf("MakeMove - incremental hash mismatch\n");
+  if (b->pawn_hash != computePawnHash(b)) printf("MakeMove - incremental pawn hash mismatch\n");
+
+  EvalTerms eval = b->eval;
+  computeEval(b);
+  if (memcmp(&eval, &b->eval, sizeof(EvalTerms)) != 0)
+    printf("MakeMove - incremental evaluation mismatch\n");
+
+  NNUEAccumulator nnue = b->nnue;
+  NNUERefresh(b);
+  if (memcmp(&nnue, &b->nnue, sizeof(NNUEAccumulator)) != 0)
+    printf("MakeMove - incremental NNUE accumulator mismatch\n");
+#endif
 }
 
 void UnmakeMove(Board *b)
 {
+#ifdef COPY_MAKE
+  UndoRecord *undo = &b->undo->records[--b->undo->count];
+
+  memcpy(b, undo->position, POSITION_SIZE);
+  if (nnue_loaded) b->nnue = undo->nnue;
+#else
   b->turn = !b->turn;
 
-  b->variation.plies_count--;
+  UndoRecord *undo = &b->undo->records[--b->undo->count];
 
-  Move m = b->variation.plies[b->variation.plies_count];
+  Move m = undo->move;
 
-  b->ep_possible   = b->state_backup[b->variation.plies_count].ep_possible;
-  b->ep_square     = b->state_backup[b->variation.plies_count].ep_square;
-  b->castle[WHITE] = b->state_backup[b->variation.plies_count].castle[WHITE];
-  b->castle[BLACK] = b->state_backup[b->variation.plies_count].castle[BLACK];
-  b->halfmove      = b->state_backup[b->variation.plies_count].halfmove;
-  b->hash_value    = b->state_backup[b->variation.plies_count].hash_value;
+  b->ep_possible   = undo->ep_square != NO_EP_SQUARE;
+  b->ep_square     = b->ep_possible ? SQ_TO_BB(undo->ep_square) : 0;
+  b->castle[WHITE] = undo->castle & (CASTLE_K | CASTLE_Q);
+  b->castle[BLACK] = undo->castle >> 2;
+  b->halfmove      = undo->halfmove;
+  b->hash_value    = undo->hash_value;
+  b->pawn_hash     = undo->pawn_hash;
+  b->eval          = undo->eval;
 
   if (m != NULL_MOVE)
   {
     int piece = GET_PIECE(m);
 
-    BB origin_bb = SQ_TO_BB(GET_ORIGIN_SQ(m));
-    BB dest_bb   = SQ_TO_BB(GET_DEST_SQ(m));
+    int origin = GET_ORIGIN_SQ(m);
+    int dest   = GET_DEST_SQ(m);
+
+    BB origin_bb = SQ_TO_BB(origin);
+    BB dest_bb   = SQ_TO_BB(dest);
 
     switch (GET_TYPE(m))
     {
       case MOVE_TYPE_SILENT:
         b->piece[b->turn][piece] ^= (origin_bb | dest_bb);
+        b->mailbox[origin] = piece;
+        b->mailbox[dest]   = PIECE_NONE;
         break;
       case MOVE_TYPE_DOUBLE_PUSH:
         b->piece[b->turn][piece] ^= (origin_bb | dest_bb);
+        b->mailbox[origin] = piece;
+        b->mailbox[dest]   = PIECE_NONE;
         break;
       case MOVE_TYPE_EP:
+      {
+        int captured_sq = b->turn == WHITE ? dest - 8 : dest + 8;
+
         b->piece[b->turn][piece] ^= (origin_bb | dest_bb);
-        b->piece[!b->turn][PAWN] |= (b->turn == WHITE ? (b->ep_square >> 8) : (b->ep_square << 8));
+        b->piece[!b->turn][PAWN] |= SQ_TO_BB(captured_sq);
+        b->mailbox[origin]      = piece;
+        b->mailbox[dest]        = PIECE_NONE;
+        b->mailbox[captured_sq] = PAWN;
         break;
+      }
       case MOVE_TYPE_CAPTURE:
         b->piece[b->turn][piece] ^= (origin_bb | dest_bb);
         b->piece[!b->turn][GET_CAPTURED_PIECE(m)] |= dest_bb;
+        b->mailbox[origin] = piece;
+        b->mailbox[dest]   = GET_CAPTURED_PIECE(m);
         break;
       case MOVE_TYPE_PROMOTION:
         b->piece[b->turn][PAWN] |= origin_bb;
         b->piece[b->turn][GET_PROMOTION_PIECE(m)] &= ~dest_bb;
+        b->mailbox[origin] = PAWN;
+        b->mailbox[dest]   = PIECE_NONE;
         break;
       case MOVE_TYPE_PROMOTION_WITH_CAPTURE:
         b->piece[b->turn][PAWN] |= origin_bb;
         b->piece[b->turn][GET_PROMOTION_PIECE(m)] &= ~dest_bb;
         b->piece[!b->turn][GET_CAPTURED_PIECE(m)] |= dest_bb;
+        b->mailbox[origin] = PAWN;
+        b->mailbox[dest]   = GET_CAPTURED_PIECE(m);
         break;
       case MOVE_TYPE_CASTLE_K:
         if (b->turn == WHITE)
         {
           b->piece[b->turn][KING] = 0x10;
           b->piece[b->turn][ROOK] ^= 0xa0;
+          b->mailbox[6] = PIECE_NONE;
+          b->mailbox[5] = PIECE_NONE;
+          b->mailbox[4] = KING;
+          b->mailbox[7] = ROOK;
         }
         else
         {
           b->piece[b->turn][KING] = 0x1000000000000000;
           b->piece[b->turn][ROOK] ^= 0xa000000000000000;
+          b->mailbox[62] = PIECE_NONE;
+          b->mailbox[61] = PIECE_NONE;
+          b->mailbox[60] = KING;
+          b->mailbox[63] = ROOK;
         }
         break;
       case MOVE_TYPE_CASTLE_Q:
@@ -550,15 +1013,30 @@ void UnmakeMove(Board *b)
         {
           b->piece[b->turn][KING] = 0x10;
           b->piece[b->turn][ROOK] ^= 0x9;
+          b->mailbox[2] = PIECE_NONE;
+          b->mailbox[3] = PIECE_NONE;
+          b->mailbox[4] = KING;
+          b->mailbox[0] = ROOK;
         }
         else
         {
           b->piece[b->turn][KING] = 0x1000000000000000;
           b->piece[b->turn][ROOK] ^= 0x900000000000000;
+          b->mailbox[58] = PIECE_NONE;
+          b->mailbox[59] = PIECE_NONE;
+          b->mailbox[60] = KING;
+          b->mailbox[56] = ROOK;
         }
         break;
     }
   }
 
   updateBitboards(b);
+
+  if (nnue_loaded && m != NULL_MOVE) NNUEUpdate(b, m, b->turn, 1);
+#endif
+
+#ifdef DEBUG_HASH
+  if (b->hash_value != computeHash(b)) printf("UnmakeMove - restored hash mismatch\n");
+#endif
 }
@@ -0,0 +1,183 @@
+#include <stddef.h>
+
+#include "main.h"
+
+// Pawn structure terms, middlegame and endgame
+#define DOUBLED_MG   -10
+#define DOUBLED_EG   -20
+#define ISOLATED_MG  -10
+#define ISOLATED_EG  -15
+#define BACKWARD_MG  -8
+#define BACKWARD_EG  -10
+#define SUPPORTED_MG 5
+#define SUPPORTED_EG 8
+
+// Passed pawn bonuses by the rank relative to the pawn's side
+static const int passed_mg[8] = {0, 5, 10, 15, 25, 40, 60, 0};
+static const int passed_eg[8] = {0, 10, 20, 35, 60, 90, 130, 0};
+
+// Added when nothing stands on the square in front of the passed pawn, it depends on the other
+// pieces so it's not cached with the pawn structure
+static const int free_passed_eg[8] = {0, 0, 5, 10, 15, 25, 40, 0};
+
+static BB forwardFill(int side, BB bb)
+{
+  if (side == WHITE)
+  {
+    bb |= bb << 8;
+    bb |= bb << 16;
+    bb |= bb << 32;
+  }
+  else
+  {
+    bb |= bb >> 8;
+    bb |= bb >> 16;
+    bb |= bb >> 32;
+  }
+
+  return bb;
+}
+
+// Squares in front of the pawns on their files, without the pawns' own squares
+static BB frontSpan(int side, BB bb)
+{
+  return forwardFill(side, side == WHITE ? bb << 8 : bb >> 8);
+}
+
+static BB adjacentFiles(BB bb) { return ((bb & ~FILE_A) >> 1) | ((bb & ~FILE_H) << 1); }
+
+static BB pawnsAttacks(int side, BB pawns)
+{
+  if (side == WHITE) return ((pawns & ~FILE_A) << 7) | ((pawns & ~FILE_H) << 9);
+  return ((pawns & ~FILE_A) >> 9) | ((pawns & ~FILE_H) >> 7);
+}
+
+static int relativeRank(int side, int sq) { return side == WHITE ? sq / 8 : 7 - sq / 8; }
+
+// Scores the pawns of one side from that side's point of view
+static void evalPawnsOf(Board *b, int side, PawnEntry *entry, int *mg, int *eg)
+{
+  BB own           = b->piece[side][PAWN];
+  BB enemy         = b->piece[!side][PAWN];
+  BB own_attacks   = pawnsAttacks(side, own);
+  BB enemy_attacks = pawnsAttacks(!side, enemy);
+
+  BB pawns = own;
+  while (pawns != 0)
+  {
+    int sq    = LSB(pawns);
+    BB  sq_bb = SQ_TO_BB(sq);
+    BB  front = frontSpan(side, sq_bb);
+    BB  file  = precomp_files[sq];
+
+    int isolated = (own & adjacentFiles(file)) == 0;
+
+    // Only the rear pawn of a doubled pair is penalized and can't be passed
+    if ((own & front) != 0)
+    {
+      *mg += DOUBLED_MG;
+      *eg += DOUBLED_EG;
+    }
+    else if ((enemy & (front | adjacentFiles(front))) == 0)
+    {
+      entry->passed[side] |= sq_bb;
+      *mg += passed_mg[relativeRank(side, sq)];
+      *eg += passed_eg[relativeRank(side, sq)];
+    }
+
+    if (isolated)
+    {
+      *mg += ISOLATED_MG;
+      *eg += ISOLATED_EG;
+    }
+    else if ((own_attacks & sq_bb) != 0)
+    {
+      *mg += SUPPORTED_MG;
+      *eg += SUPPORTED_EG;
+    }
+    else
+    {
+      // No pawn on the adjacent files can come to support it and it can't safely advance
+      BB supporters = adjacentFiles(frontSpan(!side, sq_bb) | sq_bb);
+      BB stop       = side == WHITE ? sq_bb << 8 : sq_bb >> 8;
+
+      if ((own & supporters) == 0 && (enemy_attacks & stop) != 0)
+      {
+        *mg += BACKWARD_MG;
+        *eg += BACKWARD_EG;
+      }
+    }
+
+    POP_LSB(pawns);
+  }
+}
+
+static void evalPawns(Board *b, PawnEntry *entry)
+{
+  int mg[2] = {0, 0};
+  int eg[2] = {0, 0};
+
+  entry->key       = b->pawn_hash;
+  entry->passed[0] = 0;
+  entry->passed[1] = 0;
+
+  evalPawnsOf(b, WHITE, entry, &mg[WHITE], &eg[WHITE]);
+  evalPawnsOf(b, BLACK, entry, &mg[BLACK], &eg[BLACK]);
+
+  entry->mg = mg[WHITE] - mg[BLACK];
+  entry->eg = eg[WHITE] - eg[BLACK];
+}
+
+// Pawn structure scores change rarely, so they are looked up in the thread's pawn table by the
+// pawn hash and computed only on a miss
+static PawnEntry *probePawns(Board *b, PawnTable *pawn_table, PawnEntry *scratch)
+{
+  if (pawn_table == NULL)
+  {
+    evalPawns(b, scratch);
+    return scratch;
+  }
+
+  PawnEntry *entry = &pawn_table->entries[b->pawn_hash & (PAWN_TABLE_SIZE - 1)];
+  if (entry->key != b->pawn_hash) evalPawns(b, entry);
+
+  return entry;
+}
+
+// Material and piece-square scores are kept up to date by MakeMove, the pawn structure comes from
+// the pawn table (computed directly if it's NULL). Returns the score from the side to move's point
+// of view. A loaded network replaces all of it.
+int Evaluate(Board *b, PawnTable *pawn_table)
+{
+  if (nnue_loaded) return NNUEEvaluate(b);
+
+  int who2move[2] = {1, -1};
+
+  PawnEntry  scratch;
+  PawnEntry *pawns = probePawns(b, pawn_table, &scratch);
+
+  int mg = b->eval.psq_mg + pawns->mg;
+  int eg = b->eval.psq_eg + pawns->eg;
+
+  for (int side = 0; side < 2; side++)
+  {
+    BB  passed = pawns->passed[side];
+    int sign   = side == WHITE ? 1 : -1;
+
+    while (passed != 0)
+    {
+      int sq   = LSB(passed);
+      BB  stop = side == WHITE ? SQ_TO_BB(sq) << 8 : SQ_TO_BB(sq) >> 8;
+
+      if ((b->all_pieces & stop) == 0) eg += sign * free_passed_eg[relativeRank(side, sq)];
+      POP_LSB(passed);
+    }
+  }
+
+  int phase = b->eval.phase < MAX_PHASE ? b->eval.phase : MAX_PHASE;
+  int psq   = (mg * phase + eg * (MAX_PHASE - phase)) / MAX_PHASE;
+
+  int total = b->eval.material[WHITE] - b->eval.material[BLACK] + psq;
+
+  return total * who2move[b->turn];
+}
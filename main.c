@@ -2,17 +2,87 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+// Usage:
+//   BattleBishop                    (UCI mode)
+//   BattleBishop <fen> [-hash <MB>] [-threads <n>]
+//   BattleBishop perft <depth> [-threads <n>] [-hash <MB>] [-div] [-stats] [fen]
+//
+// Perft counts only the nodes unless -stats is given, which also counts move types, checks and
+// mates but can't use bulk counting at the last ply.
+static int runPerftCommand(int argc, char *argv[])
+{
+  Board b;
+
+  int depth   = atoi(argv[2]);
+  int threads = 1;
+  int div     = 0;
+  int stats   = 0;
+  int fen     = 0;
+
+  for (int i = 3; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+      threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-hash") == 0 && i + 1 < argc)
+      SetPerftHash(atoi(argv[++i]));
+    else if (strcmp(argv[i], "-div") == 0)
+      div = 1;
+    else if (strcmp(argv[i], "-stats") == 0)
+      stats = 1;
+    else
+      fen = i;
+  }
+
+  if (fen)
+    FEN(&b, argv[fen]);
+  else
+    Startpos(&b);
+
+  if (div)
+    RunPerftDiv(&b, depth, threads, stats);
+  else
+    RunPerft(&b, depth, threads, stats);
+
+  SetPerftHash(0);
+
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
+  InitSliderAttacks();
+
+  if (argc < 2)
+  {
+    UCILoop();
+    return 0;
+  }
+  if (argc >= 3 && strcmp(argv[1], "perft") == 0) return runPerftCommand(argc, argv);
+
   Board b;
   // Startpos(&b);
   FEN(&b, argv[1]);
 
+  for (int i = 2; i + 1 < argc; i++)
+  {
+    if (strcmp(argv[i], "-hash") == 0)
+      SetHashSize(atoi(argv[++i]));
+    else if (strcmp(argv[i], "-threads") == 0)
+      SetThreads(atoi(argv[++i]));
+  }
+
+  ResetSearchStop();
+
   clock_t start = clock();
-  Search(&b);
-  clock_t end = clock();
+  Move    best  = Search(&b, NULL);
+  clock_t end   = clock();
+
+  char buff[6];
+  PrintMoveUCI(buff, best, b.turn);
+  printf("bestmove %s\n", buff);
 
   printf("Total time: %ld\n", (end - start) / CLOCKS_PER_SEC);
 }
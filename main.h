@@ -1,6 +1,8 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include <stddef.h>
+
 //
 // Sides
 //
@@ -37,7 +39,13 @@
 //
 
 #define SQ_TO_BB(sq) (1LL << (sq))
-#define BB_TO_SQ(sq) (ffsll((long long)sq) - 1)
+#define BB_TO_SQ(sq) LSB(sq)
+
+// The builtins compile to POPCNT, TZCNT and BLSR when the target supports them (see Makefile),
+// LSB is undefined for an empty bitboard
+#define POPCOUNT(bb) __builtin_popcountll(bb)
+#define LSB(bb)      __builtin_ctzll(bb)
+#define POP_LSB(bb)  ((bb) &= (bb)-1)
 
 #define FLIP_SQ(sq) ((sq) ^ 56)
 
@@ -47,6 +55,33 @@
 #define RANK_TO_FILE(bb) ((((bb)*DIAG) >> 7) & FILE_A)
 #define DIAG_TO_RANK(bb) (((bb)*FILE_A) >> 56)
 
+//
+// Sliding pieces attacks (magic bitboards, or BMI2 PEXT when built with USE_PEXT)
+//
+
+// Fancy magics: every square has its own shift and its part of a shared table, sized for the
+// blocker subsets of the square
+#define ROOK_MAGIC_INDEX(sq, occ)                                       \
+  (precomp_rook_offset[sq] +                                            \
+   ((((occ)&precomp_rook_blocker_mask[sq]) * precomp_rook_magic[sq]) >> \
+    precomp_rook_shift[sq]))
+#define BISHOP_MAGIC_INDEX(sq, occ)                                         \
+  (precomp_bishop_offset[sq] +                                              \
+   ((((occ)&precomp_bishop_blocker_mask[sq]) * precomp_bishop_magic[sq]) >> \
+    precomp_bishop_shift[sq]))
+
+#ifdef USE_PEXT
+#include <immintrin.h>
+
+#define ROOK_ATTACKS(sq, occ) \
+  (pext_rook_attacks[sq][_pext_u64(occ, precomp_rook_blocker_mask[sq])])
+#define BISHOP_ATTACKS(sq, occ) \
+  (pext_bishop_attacks[sq][_pext_u64(occ, precomp_bishop_blocker_mask[sq])])
+#else
+#define ROOK_ATTACKS(sq, occ)   (precomp_rook_moves[ROOK_MAGIC_INDEX(sq, occ)])
+#define BISHOP_ATTACKS(sq, occ) (precomp_bishop_moves[BISHOP_MAGIC_INDEX(sq, occ)])
+#endif
+
 //
 // Moves
 //
@@ -55,8 +90,12 @@
 #define GEN_ATTACKS    2
 #define GEN_PROMOTIONS 4
 #define GEN_ALL        (GEN_SILENT | GEN_ATTACKS | GEN_PROMOTIONS)
+#define GEN_LEGAL      8  // Emit only legal moves (can be combined with the flags above)
 
 #define MAX_MOVES 256
+#define MAX_PLY   128  // Moves a board can make past the position it was set up with
+
+#define NO_EP_SQUARE 64
 
 #define NULL_MOVE 0b00000000000000000000000000000000
 
@@ -86,6 +125,16 @@
 #define CREATE_MOVE(o, d, c, pp, p, t) \
   ((o) | ((d) << 6) | ((c) << 12) | ((pp) << 15) | ((p) << 18) | (t))
 
+//
+// Evaluation
+//
+
+#define MAX_PHASE 24  // Game phase with all pieces on the board
+
+#define PAWN_TABLE_SIZE 16384  // Entries of the per-thread pawn structure cache, a power of 2
+
+#define NNUE_HIDDEN 256  // Accumulator size of one perspective
+
 //
 // Types
 //
@@ -94,14 +143,37 @@ typedef unsigned long long BB;
 
 typedef unsigned long Move;
 
+// Evaluation terms updated incrementally by MakeMove, the piece-square scores are from white's
+// point of view
 typedef struct
 {
-  int           ep_possible;
-  BB            ep_square;
-  unsigned char castle[2];
-  int           halfmove;
-  BB            hash_value;
-} BoardStateBackup;
+  int material[2];
+  int psq_mg;  // Middlegame
+  int psq_eg;  // Endgame
+  int phase;
+} EvalTerms;
+
+// Cached pawn structure evaluation, the scores are from white's point of view. A zeroed entry is
+// valid for the position without pawns, its key is 0.
+typedef struct
+{
+  BB  key;
+  int mg;
+  int eg;
+  BB  passed[2];
+} PawnEntry;
+
+typedef struct
+{
+  PawnEntry entries[PAWN_TABLE_SIZE];
+} PawnTable;
+
+// First layer outputs of the network for both perspectives, updated incrementally by MakeMove and
+// UnmakeMove while a network is loaded
+typedef struct
+{
+  short values[2][NNUE_HIDDEN];
+} NNUEAccumulator;
 
 typedef struct
 {
@@ -117,6 +189,9 @@ typedef struct
   BB pieces_of[2];
   BB all_pieces;
 
+  // Piece type on each square (PIECE_NONE if empty), color is taken from pieces_of
+  unsigned char mailbox[64];
+
   unsigned char castle[2];
 
   int halfmove;
@@ -126,20 +201,73 @@ typedef struct
   BB  ep_square;
 
   BB hash_value;
+  BB pawn_hash;  // Hash of the pawns only, keys the pawn structure evaluation cache
+
+  EvalTerms eval;
 
-  Variation        variation;
-  BoardStateBackup state_backup[MAX_MOVES];
+  // The fields above are the position, which MakeMove copies in copy-make mode (see UndoRecord)
+  NNUEAccumulator   nnue;
+  struct UndoStack *undo;
 } Board;
 
+#define POSITION_SIZE offsetof(Board, nnue)
+
+#ifdef COPY_MAKE
+// The position before the move, UnmakeMove copies it back instead of undoing the move
+typedef struct
+{
+  Move            move;
+  unsigned char   position[POSITION_SIZE];
+  NNUEAccumulator nnue;  // Only while a network is loaded
+} UndoRecord;
+#else
+// What MakeMove changed besides the pieces, for UnmakeMove. The moved and captured pieces are
+// encoded in the move.
+typedef struct
+{
+  Move           move;
+  BB             hash_value;
+  BB             pawn_hash;
+  EvalTerms      eval;
+  unsigned short halfmove;
+  unsigned char  castle;     // White's rights in the lowest 2 bits, black's in the next 2
+  unsigned char  ep_square;  // NO_EP_SQUARE if en passant was not possible
+} UndoRecord;
+#endif
+
+// Moves made on a board since the root, kept apart from the position so copies of a board stay
+// small. Every board that makes moves needs a stack of its own (see SetUndoStack).
+typedef struct UndoStack
+{
+  UndoRecord records[MAX_PLY];
+  int        count;
+} UndoStack;
+
 typedef struct
 {
-  int total;
-  int eps;
-  int castles;
-  int promotions;
-  int captures;
+  unsigned long long total;
+  unsigned long long eps;
+  unsigned long long castles;
+  unsigned long long promotions;
+  unsigned long long captures;
+  unsigned long long checks;
+  unsigned long long discovery_checks;
+  unsigned long long double_checks;
+  unsigned long long checkmates;
 } PerftResult;
 
+// Limits of a search, zero values mean no limit
+typedef struct
+{
+  int                depth;
+  unsigned long long nodes;
+  int                movetime;  // ms
+  int                time[2];   // Remaining clock time of both sides in ms
+  int                inc[2];
+  int                movestogo;
+  int                infinite;
+} SearchLimits;
+
 //
 // Precomputed values
 //
@@ -148,38 +276,73 @@ extern const BB precomp_knight_moves[64];
 extern const BB precomp_files[64];
 extern const BB precomp_ranks[64];
 extern const BB precomp_rook_blocker_mask[64];
-extern const BB precomp_rook_magic[64];
-extern const BB precomp_rook_moves[64][4096];
-extern const BB precomp_bishop_blocker_mask[64];
-extern const BB precomp_bishop_magic[64];
-extern const BB precomp_bishop_moves[64][512];
+extern const BB            precomp_rook_magic[64];
+extern const unsigned char precomp_rook_shift[64];
+extern const unsigned int  precomp_rook_offset[64];
+extern const BB            precomp_rook_moves[102400];
+extern const BB            precomp_bishop_blocker_mask[64];
+extern const BB            precomp_bishop_magic[64];
+extern const unsigned char precomp_bishop_shift[64];
+extern const unsigned int  precomp_bishop_offset[64];
+extern const BB            precomp_bishop_moves[5248];
 extern const BB precomp_in_between[64][64];
 extern const BB precomp_hash[64][12];
 extern const BB precomp_hash_castle[2][2];
 extern const BB precomp_hash_turn[2];
 extern const BB precomp_hash_ep[64];
 
+#ifdef USE_PEXT
+// Filled by InitSliderAttacks, every square points to its own part of a shared table
+extern const BB *pext_rook_attacks[64];
+extern const BB *pext_bishop_attacks[64];
+#endif
+
 //
 // Functions
 //
+void InitSliderAttacks();
+
+void SetUndoStack(Board *b, UndoStack *undo);
 void Startpos(Board *b);
 void FEN(Board *b, char *str);
 int  SquareAttackedBy(Board *b, int side, int sq);
+BB   AttackersTo(Board *b, int side, int sq, BB occupancy);
 int  IsKingAttacked(Board *b, int side);
+int  SEE(Board *b, Move m);
 int  IsLegal(Board *b, Move m);
 int  GetPieceAt(Board *b, BB s);
 void PrintMoveStr(char buff[], Move m);
+void PrintMoveUCI(char buff[], Move m, int side);
 void MakeMove(Board *b, Move m);
 void UnmakeMove(Board *b);
 void PrintBoard(Board *b);
 int  GetTotalMaterial(Board *b, int side);
 int  IsEndgmae(Board *b);
 
+int Evaluate(Board *b, PawnTable *pawn_table);
+
+// Set while a network is loaded, otherwise Evaluate uses the classical evaluation
+extern int nnue_loaded;
+
+int  NNUELoad(char *path);
+void NNUERefresh(Board *b);
+void NNUEUpdate(Board *b, Move m, int side, int undo);
+int  NNUEEvaluate(Board *b);
+
 void Generate(Board *b, int side, int type, Move move_list[], int *move_count);
+int  IsValidMove(Board *b, Move m);
+
+void RunPerft(Board *b, int depth, int threads, int stats);
+void RunPerftDiv(Board *b, int depth, int threads, int stats);
+void SetPerftHash(int size_mb);
 
-void RunPerft(Board *b, int depth);
-void RunPerftDiv(Board *b, int depth);
+Move Search(Board *b, SearchLimits *limits);
+void StopSearch();
+void ResetSearchStop();
+void SetHashSize(int size_mb);
+void SetThreads(int threads);
+void ClearHash();
 
-Move Search(Board *b);
+void UCILoop();
 
 #endif
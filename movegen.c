@@ -2,7 +2,74 @@
 
 #include "main.h"
 
-static void genPawnAttacks(Board *b, Move *move_list, int *move_count, int side)
+// Destination restrictions for legal move generation. In pseudo-legal mode the masks let
+// everything through.
+typedef struct
+{
+  int legal;
+  BB  target;  // Squares capturing or blocking the checking piece, all squares if not in check
+  BB  pinned;
+  BB  pin_ray[64];  // Squares a pinned piece can move to (the pin line including the pinner)
+} Restrictions;
+
+static void initRestrictions(Board *b, int side, Restrictions *r)
+{
+  int sniper;
+
+  int king = BB_TO_SQ(b->piece[side][KING]);
+
+  BB checkers = AttackersTo(b, !side, king, b->all_pieces);
+
+  r->legal  = 1;
+  r->pinned = 0;
+
+  if (checkers == 0)
+    r->target = ~0ULL;
+  else if ((checkers & (checkers - 1)) == 0)
+    r->target = checkers | precomp_in_between[king][BB_TO_SQ(checkers)];
+  else  // Double check, only the king can move
+    r->target = 0;
+
+  // Enemy sliders that would attack the king if our pieces were removed
+  BB snipers =
+      (ROOK_ATTACKS(king, b->pieces_of[!side]) & (b->piece[!side][ROOK] | b->piece[!side][QUEEN])) |
+      (BISHOP_ATTACKS(king, b->pieces_of[!side]) &
+       (b->piece[!side][BISHOP] | b->piece[!side][QUEEN]));
+
+  while (snipers != 0)
+  {
+    sniper = LSB(snipers);
+
+    BB between = precomp_in_between[king][sniper] & b->all_pieces;
+
+    if (between != 0 && (between & (between - 1)) == 0 && (between & b->pieces_of[side]) != 0)
+    {
+      r->pinned |= between;
+      r->pin_ray[BB_TO_SQ(between)] = precomp_in_between[king][sniper] | SQ_TO_BB(sniper);
+    }
+
+    POP_LSB(snipers);
+  }
+}
+
+static BB allowedDestinations(Restrictions *r, int sq)
+{
+  if ((r->pinned & SQ_TO_BB(sq)) != 0) return r->target & r->pin_ray[sq];
+  return r->target;
+}
+
+// En passant removes two pieces from the capturing rank, so it is checked directly
+static int isEpLegal(Board *b, int side, int origin, int dest)
+{
+  int captured_sq = side == WHITE ? dest - 8 : dest + 8;
+  int king        = BB_TO_SQ(b->piece[side][KING]);
+
+  BB occupancy = (b->all_pieces & ~SQ_TO_BB(origin) & ~SQ_TO_BB(captured_sq)) | SQ_TO_BB(dest);
+
+  return (AttackersTo(b, !side, king, occupancy) & ~SQ_TO_BB(captured_sq)) == 0;
+}
+
+static void genPawnAttacks(Board *b, Move *move_list, int *move_count, int side, Restrictions *r)
 {
   int sq;
   BB  sq_bb;
@@ -25,50 +92,49 @@ static void genPawnAttacks(Board *b, Move *move_list, int *move_count, int side)
 
   for (int lr = 0; lr < 2; lr++)
   {
-    while ((sq = ffsll((long long)attacks[lr])) != 0)
+    while (attacks[lr] != 0)
     {
-      sq--;
+      sq = LSB(attacks[lr]);
       sq_bb = SQ_TO_BB(sq);
 
       const int origin_direction[2][2] = {/* White: */ {-7, -9}, /* Black: */ {9, 7}};
 
-      if (sq >= 56 || sq <= 7)  // Promotions
+      int origin = sq + origin_direction[side][lr];
+
+      if (b->ep_possible && sq_bb == b->ep_square)  // EP
       {
-        for (int i = 1; i < 5; i++)
+        if (!r->legal || isEpLegal(b, side, origin, sq))
         {
-          move_list[*move_count] = CREATE_MOVE(
-              sq + origin_direction[side][lr],
-              sq,
-              GetPieceAt(b, sq_bb),
-              i,
-              PAWN,
-              MOVE_TYPE_PROMOTION_WITH_CAPTURE
-          );
+          move_list[*move_count] = CREATE_MOVE(origin, sq, PAWN, 0, PAWN, MOVE_TYPE_EP);
           (*move_count)++;
         }
       }
-      else  // No promotion
+      else if ((allowedDestinations(r, origin) & sq_bb) != 0)
       {
-        if (b->ep_possible && sq_bb == b->ep_square)  // EP
+        if (sq >= 56 || sq <= 7)  // Promotions
         {
-          move_list[*move_count] =
-              CREATE_MOVE(sq + origin_direction[side][lr], sq, PAWN, 0, PAWN, MOVE_TYPE_EP);
+          for (int i = 1; i < 5; i++)
+          {
+            move_list[*move_count] = CREATE_MOVE(
+                origin, sq, b->mailbox[sq], i, PAWN, MOVE_TYPE_PROMOTION_WITH_CAPTURE
+            );
+            (*move_count)++;
+          }
         }
         else  // Normal capture
         {
-          move_list[*move_count] = CREATE_MOVE(
-              sq + origin_direction[side][lr], sq, GetPieceAt(b, sq_bb), 0, PAWN, MOVE_TYPE_CAPTURE
-          );
+          move_list[*move_count] =
+              CREATE_MOVE(origin, sq, b->mailbox[sq], 0, PAWN, MOVE_TYPE_CAPTURE);
+          (*move_count)++;
         }
-        (*move_count)++;
       }
 
-      attacks[lr] &= ~sq_bb;
+      POP_LSB(attacks[lr]);
     }
   };
 }
 
-static void genPawnPushes(Board *b, Move *move_list, int *move_count, int side)
+static void genPawnPushes(Board *b, Move *move_list, int *move_count, int side, Restrictions *r)
 {
   int sq;
   BB  sq_bb;
@@ -86,36 +152,42 @@ static void genPawnPushes(Board *b, Move *move_list, int *move_count, int side)
     pushes[1] = ((pushes[0] & 0xff0000000000) >> 8) & ~b->all_pieces;
   }
 
-  while ((sq = ffsll((long long)pushes[0])) != 0)
+  while (pushes[0] != 0)
   {
     const int origin_direction[2] = {-8, 8};
 
-    sq--;
+    sq = LSB(pushes[0]);
     sq_bb = SQ_TO_BB(sq);
 
-    move_list[*move_count] =
-        CREATE_MOVE(sq + origin_direction[side], sq, 0, 0, PAWN, MOVE_TYPE_SILENT);
-    (*move_count)++;
+    if ((allowedDestinations(r, sq + origin_direction[side]) & sq_bb) != 0)
+    {
+      move_list[*move_count] =
+          CREATE_MOVE(sq + origin_direction[side], sq, 0, 0, PAWN, MOVE_TYPE_SILENT);
+      (*move_count)++;
+    }
 
-    pushes[0] &= ~sq_bb;
+    POP_LSB(pushes[0]);
   }
 
-  while ((sq = ffsll((long long)pushes[1])) != 0)
+  while (pushes[1] != 0)
   {
     const int origin_direction[2] = {-16, 16};
 
-    sq--;
+    sq = LSB(pushes[1]);
     sq_bb = SQ_TO_BB(sq);
 
-    move_list[*move_count] =
-        CREATE_MOVE(sq + origin_direction[side], sq, 0, 0, PAWN, MOVE_TYPE_DOUBLE_PUSH);
-    (*move_count)++;
+    if ((allowedDestinations(r, sq + origin_direction[side]) & sq_bb) != 0)
+    {
+      move_list[*move_count] =
+          CREATE_MOVE(sq + origin_direction[side], sq, 0, 0, PAWN, MOVE_TYPE_DOUBLE_PUSH);
+      (*move_count)++;
+    }
 
-    pushes[1] &= ~sq_bb;
+    POP_LSB(pushes[1]);
   }
 }
 
-static void genPromotions(Board *b, Move *move_list, int *move_count, int side)
+static void genPromotions(Board *b, Move *move_list, int *move_count, int side, Restrictions *r)
 {
   int sq;
   BB  sq_bb;
@@ -127,37 +199,42 @@ static void genPromotions(Board *b, Move *move_list, int *move_count, int side)
   else
     promotions = (b->piece[side][PAWN] >> 8) & RANK_1 & ~b->all_pieces;
 
-  while ((sq = ffsll((long long)promotions)) != 0)
+  while (promotions != 0)
   {
     const int origin_direction[2] = {-8, 8};
 
-    sq--;
+    sq = LSB(promotions);
     sq_bb = SQ_TO_BB(sq);
 
-    for (int i = 1; i < 5; i++)
+    if ((allowedDestinations(r, sq + origin_direction[side]) & sq_bb) != 0)
     {
-      move_list[*move_count] =
-          CREATE_MOVE(sq + origin_direction[side], sq, 0, i, PAWN, MOVE_TYPE_PROMOTION);
+      for (int i = 1; i < 5; i++)
+      {
+        move_list[*move_count] =
+            CREATE_MOVE(sq + origin_direction[side], sq, 0, i, PAWN, MOVE_TYPE_PROMOTION);
 
-      (*move_count)++;
+        (*move_count)++;
+      }
     }
 
-    promotions &= ~sq_bb;
+    POP_LSB(promotions);
   }
 }
 
-static void genKnight(Board *b, Move *move_list, int *move_count, int side, int type)
+static void genKnight(
+    Board *b, Move *move_list, int *move_count, int side, int type, Restrictions *r
+)
 {
   int knight, sq;
   BB  sq_bb;
 
   BB knights = b->piece[side][KNIGHT];
 
-  while ((knight = ffsll((long long)knights)) != 0)
+  while (knights != 0)
   {
-    knight--;
+    knight = LSB(knights);
 
-    BB destinations = precomp_knight_moves[knight];
+    BB destinations = precomp_knight_moves[knight] & allowedDestinations(r, knight);
 
     switch (type)
     {
@@ -172,15 +249,15 @@ static void genKnight(Board *b, Move *move_list, int *move_count, int side, int
         break;
     }
 
-    while ((sq = ffsll((long long)destinations)) != 0)
+    while (destinations != 0)
     {
-      sq--;
+      sq = LSB(destinations);
       sq_bb = SQ_TO_BB(sq);
 
       if ((sq_bb & b->pieces_of[!side]) != 0)
       {
         move_list[*move_count] =
-            CREATE_MOVE(knight, sq, GetPieceAt(b, sq_bb), 0, KNIGHT, MOVE_TYPE_CAPTURE);
+            CREATE_MOVE(knight, sq, b->mailbox[sq], 0, KNIGHT, MOVE_TYPE_CAPTURE);
       }
       else
       {
@@ -188,14 +265,14 @@ static void genKnight(Board *b, Move *move_list, int *move_count, int side, int
       }
       (*move_count)++;
 
-      destinations &= ~sq_bb;
+      POP_LSB(destinations);
     }
 
-    knights &= ~SQ_TO_BB(knight);
+    POP_LSB(knights);
   }
 }
 
-static void genKing(Board *b, Move *move_list, int *move_count, int side, int type)
+static void genKing(Board *b, Move *move_list, int *move_count, int side, int type, Restrictions *r)
 {
   int sq, king;
   BB  sq_bb;
@@ -217,27 +294,33 @@ static void genKing(Board *b, Move *move_list, int *move_count, int side, int ty
       break;
   }
 
-  while ((sq = ffsll((long long)destinations)) != 0)
+  while (destinations != 0)
   {
-    sq--;
+    sq = LSB(destinations);
     sq_bb = SQ_TO_BB(sq);
 
+    POP_LSB(destinations);
+
+    // The king must not stay on the line of a slider it is moving away from
+    if (r->legal && AttackersTo(b, !side, sq, b->all_pieces & ~b->piece[side][KING]) != 0)
+      continue;
+
     if ((sq_bb & b->pieces_of[!side]) != 0)
     {
       move_list[*move_count] =
-          CREATE_MOVE(king, sq, GetPieceAt(b, sq_bb), 0, KING, MOVE_TYPE_CAPTURE);
+          CREATE_MOVE(king, sq, b->mailbox[sq], 0, KING, MOVE_TYPE_CAPTURE);
     }
     else
     {
       move_list[*move_count] = CREATE_MOVE(king, sq, 0, 0, KING, MOVE_TYPE_SILENT);
     }
     (*move_count)++;
-
-    destinations &= ~sq_bb;
   }
 }
 
-static void genSliding(Board *b, Move *move_list, int *move_count, int side, int type)
+static void genSliding(
+    Board *b, Move *move_list, int *move_count, int side, int type, Restrictions *r
+)
 {
   int sq, piece;
   BB  sq_bb;
@@ -246,27 +329,16 @@ static void genSliding(Board *b, Move *move_list, int *move_count, int side, int
   {
     BB pieces = b->piece[side][p];
 
-    while ((piece = ffsll((long long)pieces)) != 0)
+    while (pieces != 0)
     {
-      piece--;
-      BB piece_bb = SQ_TO_BB(piece);
+      piece = LSB(pieces);
 
       BB destinations = 0;
 
-      if (p == ROOK | p == QUEEN)
-      {
-        BB blockers = b->all_pieces;
-        blockers &= precomp_rook_blocker_mask[piece];
-        destinations |=
-            precomp_rook_moves[piece][(blockers * precomp_rook_magic[piece]) >> (64 - 12)];
-      }
-      if (p == BISHOP | p == QUEEN)
-      {
-        BB blockers = b->all_pieces;
-        blockers &= precomp_bishop_blocker_mask[piece];
-        destinations |=
-            precomp_bishop_moves[piece][(blockers * precomp_bishop_magic[piece]) >> (64 - 9)];
-      }
+      if (p == ROOK | p == QUEEN) destinations |= ROOK_ATTACKS(piece, b->all_pieces);
+      if (p == BISHOP | p == QUEEN) destinations |= BISHOP_ATTACKS(piece, b->all_pieces);
+
+      destinations &= allowedDestinations(r, piece);
 
       switch (type)
       {
@@ -281,15 +353,15 @@ static void genSliding(Board *b, Move *move_list, int *move_count, int side, int
           break;
       }
 
-      while ((sq = ffsll((long long)destinations)) != 0)
+      while (destinations != 0)
       {
-        sq--;
+        sq = LSB(destinations);
         sq_bb = SQ_TO_BB(sq);
 
         if ((sq_bb & b->pieces_of[!side]) != 0)
         {
           move_list[*move_count] =
-              CREATE_MOVE(piece, sq, GetPieceAt(b, sq_bb), 0, p, MOVE_TYPE_CAPTURE);
+              CREATE_MOVE(piece, sq, b->mailbox[sq], 0, p, MOVE_TYPE_CAPTURE);
         }
         else
         {
@@ -297,10 +369,10 @@ static void genSliding(Board *b, Move *move_list, int *move_count, int side, int
         }
         (*move_count)++;
 
-        destinations &= ~sq_bb;
+        POP_LSB(destinations);
       }
 
-      pieces &= ~piece_bb;
+      POP_LSB(pieces);
     }
   }
 }
@@ -352,23 +424,162 @@ void Generate(Board *b, int side, int type, Move move_list[], int *move_count)
 {
   *move_count = 0;
 
+  Restrictions r;
+
+  if ((type & GEN_LEGAL) == GEN_LEGAL)
+    initRestrictions(b, side, &r);
+  else
+  {
+    r.legal  = 0;
+    r.target = ~0ULL;
+    r.pinned = 0;
+  }
+
+  // In double check only king moves are generated
+  if (r.target == 0)
+  {
+    if ((type & GEN_ATTACKS) == GEN_ATTACKS)
+      genKing(b, move_list, move_count, side, GEN_ATTACKS, &r);
+    if ((type & GEN_SILENT) == GEN_SILENT)
+      genKing(b, move_list, move_count, side, GEN_SILENT, &r);
+    return;
+  }
+
   if ((type & GEN_ATTACKS) == GEN_ATTACKS)
   {
-    genPawnAttacks(b, move_list, move_count, side);
-    genKnight(b, move_list, move_count, side, GEN_ATTACKS);
-    genSliding(b, move_list, move_count, side, GEN_ATTACKS);
-    genKing(b, move_list, move_count, side, GEN_ATTACKS);
+    genPawnAttacks(b, move_list, move_count, side, &r);
+    genKnight(b, move_list, move_count, side, GEN_ATTACKS, &r);
+    genSliding(b, move_list, move_count, side, GEN_ATTACKS, &r);
+    genKing(b, move_list, move_count, side, GEN_ATTACKS, &r);
   }
   if ((type & GEN_PROMOTIONS) == GEN_PROMOTIONS)
   {
-    genPromotions(b, move_list, move_count, side);
+    genPromotions(b, move_list, move_count, side, &r);
   }
   if ((type & GEN_SILENT) == GEN_SILENT)
   {
-    genPawnPushes(b, move_list, move_count, side);
-    genKnight(b, move_list, move_count, side, GEN_SILENT);
-    genSliding(b, move_list, move_count, side, GEN_SILENT);
-    genKing(b, move_list, move_count, side, GEN_SILENT);
+    genPawnPushes(b, move_list, move_count, side, &r);
+    genKnight(b, move_list, move_count, side, GEN_SILENT, &r);
+    genSliding(b, move_list, move_count, side, GEN_SILENT, &r);
+    genKing(b, move_list, move_count, side, GEN_SILENT, &r);
     genCastles(b, move_list, move_count, side);
   }
 }
+
+static BB pawnAttacks(int sq, int side)
+{
+  BB sq_bb = SQ_TO_BB(sq);
+
+  if (side == WHITE) return ((sq_bb & ~FILE_A) << 7) | ((sq_bb & ~FILE_H) << 9);
+  return ((sq_bb & ~FILE_A) >> 9) | ((sq_bb & ~FILE_H) >> 7);
+}
+
+static int isPawnMoveValid(Board *b, Move m, int side)
+{
+  const int forward[2] = {8, -8};
+
+  int origin = GET_ORIGIN_SQ(m);
+  int dest   = GET_DEST_SQ(m);
+
+  int last_rank = (SQ_TO_BB(dest) & (RANK_1 | RANK_8)) != 0;
+
+  switch (GET_TYPE(m))
+  {
+    case MOVE_TYPE_SILENT:
+      return dest - origin == forward[side] && !last_rank;
+    case MOVE_TYPE_PROMOTION:
+      return dest - origin == forward[side] && last_rank;
+    case MOVE_TYPE_DOUBLE_PUSH:
+      return dest - origin == 2 * forward[side] && (origin >> 3) == (side == WHITE ? 1 : 6) &&
+             (b->all_pieces & SQ_TO_BB(origin + forward[side])) == 0;
+    case MOVE_TYPE_CAPTURE:
+      return (pawnAttacks(origin, side) & SQ_TO_BB(dest)) != 0 && !last_rank;
+    case MOVE_TYPE_PROMOTION_WITH_CAPTURE:
+      return (pawnAttacks(origin, side) & SQ_TO_BB(dest)) != 0 && last_rank;
+    case MOVE_TYPE_EP:
+      return (pawnAttacks(origin, side) & SQ_TO_BB(dest)) != 0 && b->ep_possible &&
+             b->ep_square == SQ_TO_BB(dest) && GET_CAPTURED_PIECE(m) == PAWN;
+  }
+
+  return 0;
+}
+
+// Checks a move that wasn't generated for this position (e.g. a move from the tt) without
+// generating the whole move list
+int IsValidMove(Board *b, Move m)
+{
+  int side = b->turn;
+  int type = GET_TYPE(m);
+
+  if (m == NULL_MOVE) return 0;
+
+  if (type == MOVE_TYPE_CASTLE_K || type == MOVE_TYPE_CASTLE_Q)
+  {
+    Move castles[2];
+    int  castles_count = 0;
+
+    genCastles(b, castles, &castles_count, side);
+    for (int i = 0; i < castles_count; i++)
+      if (castles[i] == m) return 1;
+    return 0;
+  }
+
+  int origin = GET_ORIGIN_SQ(m);
+  int dest   = GET_DEST_SQ(m);
+  int piece  = GET_PIECE(m);
+
+  BB origin_bb = SQ_TO_BB(origin);
+  BB dest_bb   = SQ_TO_BB(dest);
+
+  if ((b->pieces_of[side] & origin_bb) == 0 || b->mailbox[origin] != piece) return 0;
+
+  int promotion = type == MOVE_TYPE_PROMOTION || type == MOVE_TYPE_PROMOTION_WITH_CAPTURE;
+  if (promotion != (piece == PAWN && GET_PROMOTION_PIECE(m) >= KNIGHT &&
+                    GET_PROMOTION_PIECE(m) <= BISHOP))
+    return 0;
+  if (!promotion && GET_PROMOTION_PIECE(m) != 0) return 0;
+
+  if (type == MOVE_TYPE_CAPTURE || type == MOVE_TYPE_PROMOTION_WITH_CAPTURE)
+  {
+    if ((b->pieces_of[!side] & dest_bb) == 0 || b->mailbox[dest] != GET_CAPTURED_PIECE(m))
+      return 0;
+  }
+  else if ((b->all_pieces & dest_bb) != 0 || (type != MOVE_TYPE_EP && GET_CAPTURED_PIECE(m) != 0))
+    return 0;
+
+  if (piece != PAWN && type != MOVE_TYPE_SILENT && type != MOVE_TYPE_CAPTURE) return 0;
+
+  BB destinations;
+  switch (piece)
+  {
+    case PAWN:
+      if (!isPawnMoveValid(b, m, side)) return 0;
+      if (type == MOVE_TYPE_EP) return isEpLegal(b, side, origin, dest);
+      destinations = dest_bb;
+      break;
+    case KNIGHT:
+      destinations = precomp_knight_moves[origin];
+      break;
+    case ROOK:
+      destinations = ROOK_ATTACKS(origin, b->all_pieces);
+      break;
+    case BISHOP:
+      destinations = BISHOP_ATTACKS(origin, b->all_pieces);
+      break;
+    case QUEEN:
+      destinations = ROOK_ATTACKS(origin, b->all_pieces) | BISHOP_ATTACKS(origin, b->all_pieces);
+      break;
+    case KING:
+      if ((precomp_king_moves[origin] & dest_bb) == 0) return 0;
+      return AttackersTo(b, !side, dest, b->all_pieces & ~origin_bb) == 0;
+    default:
+      return 0;
+  }
+
+  if ((destinations & dest_bb) == 0) return 0;
+
+  Restrictions r;
+  initRestrictions(b, side, &r);
+
+  return (allowedDestinations(&r, origin) & dest_bb) != 0;
+}
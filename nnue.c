@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#include "main.h"
+
+// HalfKP network: (own king square, piece, square) features of both perspectives, every one
+// transformed to NNUE_HIDDEN values, followed by two small dense layers. Kings are not features,
+// moving one refreshes the accumulator of its side.
+//
+// Black's perspective is flipped vertically, so both sides see themselves at the bottom.
+#define NNUE_PIECES   10  // Pawn to bishop, own and enemy
+#define NNUE_FEATURES (64 * NNUE_PIECES * 64)
+#define NNUE_L1       32
+#define NNUE_L2       32
+
+// The hidden layer weights are scaled by 2^NNUE_WEIGHT_SHIFT and the output by NNUE_OUTPUT_SCALE
+#define NNUE_WEIGHT_SHIFT 6
+#define NNUE_OUTPUT_SCALE 16
+
+// Weights file: "BBNN", version and NNUE_HIDDEN as 32-bit integers, then every layer's biases
+// followed by its weights, row by row, little endian
+#define NNUE_MAGIC   "BBNN"
+#define NNUE_VERSION 1
+
+int nnue_loaded = 0;
+
+static short ft_biases[NNUE_HIDDEN];
+static short ft_weights[NNUE_FEATURES * NNUE_HIDDEN];
+
+static int         l1_biases[NNUE_L1];
+static signed char l1_weights[NNUE_L1][2 * NNUE_HIDDEN];
+static int         l2_biases[NNUE_L2];
+static signed char l2_weights[NNUE_L2][NNUE_L1];
+static int         out_bias;
+static signed char out_weights[NNUE_L2];
+
+static int readArray(FILE *f, void *dest, size_t size, size_t count)
+{
+  return fread(dest, size, count, f) == count;
+}
+
+int NNUELoad(char *path)
+{
+  nnue_loaded = 0;
+
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+  {
+    printf("NNUELoad - cannot open %s\n", path);
+    return 0;
+  }
+
+  char         magic[4];
+  unsigned int header[2];
+
+  int ok = readArray(f, magic, 1, 4) && memcmp(magic, NNUE_MAGIC, 4) == 0;
+  ok     = ok && readArray(f, header, sizeof(unsigned int), 2);
+  ok     = ok && header[0] == NNUE_VERSION && header[1] == NNUE_HIDDEN;
+
+  ok = ok && readArray(f, ft_biases, sizeof(short), NNUE_HIDDEN);
+  ok = ok && readArray(f, ft_weights, sizeof(short), NNUE_FEATURES * NNUE_HIDDEN);
+  ok = ok && readArray(f, l1_biases, sizeof(int), NNUE_L1);
+  ok = ok && readArray(f, l1_weights, 1, sizeof(l1_weights));
+  ok = ok && readArray(f, l2_biases, sizeof(int), NNUE_L2);
+  ok = ok && readArray(f, l2_weights, 1, sizeof(l2_weights));
+  ok = ok && readArray(f, &out_bias, sizeof(int), 1);
+  ok = ok && readArray(f, out_weights, 1, sizeof(out_weights));
+  ok = ok && fgetc(f) == EOF;
+
+  fclose(f);
+
+  if (!ok)
+  {
+    printf("NNUELoad - %s is not a valid network\n", path);
+    return 0;
+  }
+
+  nnue_loaded = 1;
+  return 1;
+}
+
+static int featureIndex(int perspective, int king, int side, int piece, int sq)
+{
+  if (perspective == BLACK)
+  {
+    king = FLIP_SQ(king);
+    sq   = FLIP_SQ(sq);
+  }
+
+  return (king * NNUE_PIECES + piece * 2 + (side != perspective)) * 64 + sq;
+}
+
+// Adds the weights of the added features to the accumulator and subtracts the removed ones, in a
+// single pass over the accumulator
+static void updateAccumulator(
+    short *acc, int added[], int added_count, int removed[], int removed_count
+)
+{
+#if defined(__AVX2__)
+  for (int i = 0; i < NNUE_HIDDEN; i += 16)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i *)(acc + i));
+
+    for (int j = 0; j < removed_count; j++)
+      v = _mm256_sub_epi16(
+          v, _mm256_loadu_si256((__m256i *)(ft_weights + removed[j] * NNUE_HIDDEN + i))
+      );
+    for (int j = 0; j < added_count; j++)
+      v = _mm256_add_epi16(
+          v, _mm256_loadu_si256((__m256i *)(ft_weights + added[j] * NNUE_HIDDEN + i))
+      );
+
+    _mm256_storeu_si256((__m256i *)(acc + i), v);
+  }
+#elif defined(__SSE4_1__)
+  for (int i = 0; i < NNUE_HIDDEN; i += 8)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)(acc + i));
+
+    for (int j = 0; j < removed_count; j++)
+      v = _mm_sub_epi16(
+          v, _mm_loadu_si128((__m128i *)(ft_weights + removed[j] * NNUE_HIDDEN + i))
+      );
+    for (int j = 0; j < added_count; j++)
+      v = _mm_add_epi16(
+          v, _mm_loadu_si128((__m128i *)(ft_weights + added[j] * NNUE_HIDDEN + i))
+      );
+
+    _mm_storeu_si128((__m128i *)(acc + i), v);
+  }
+#else
+  for (int j = 0; j < removed_count; j++)
+    for (int i = 0; i < NNUE_HIDDEN; i++) acc[i] -= ft_weights[removed[j] * NNUE_HIDDEN + i];
+  for (int j = 0; j < added_count; j++)
+    for (int i = 0; i < NNUE_HIDDEN; i++) acc[i] += ft_weights[added[j] * NNUE_HIDDEN + i];
+#endif
+}
+
+static void refreshPerspective(Board *b, int perspective)
+{
+  short *acc  = b->nnue.values[perspective];
+  int    king = BB_TO_SQ(b->piece[perspective][KING]);
+
+  // There are at most 30 pieces other than the kings
+  int features[30];
+  int features_count = 0;
+
+  for (int side = 0; side < 2; side++)
+    for (int piece = 0; piece < KING; piece++)
+    {
+      BB pieces = b->piece[side][piece];
+
+      while (pieces != 0)
+      {
+        features[features_count++] = featureIndex(perspective, king, side, piece, LSB(pieces));
+        POP_LSB(pieces);
+      }
+    }
+
+  memcpy(acc, ft_biases, sizeof(ft_biases));
+  updateAccumulator(acc, features, features_count, NULL, 0);
+}
+
+void NNUERefresh(Board *b)
+{
+  if (!nnue_loaded) return;
+
+  refreshPerspective(b, WHITE);
+  refreshPerspective(b, BLACK);
+}
+
+// A piece of a side on a square, added to or removed from the board by a move
+typedef struct
+{
+  int side;
+  int piece;
+  int sq;
+} PieceDelta;
+
+// Called after the board is updated by MakeMove (undo = 0) or UnmakeMove (undo = 1), side is the
+// side that made the move
+void NNUEUpdate(Board *b, Move m, int side, int undo)
+{
+  PieceDelta added[2], removed[2];
+  int        added_count   = 0;
+  int        removed_count = 0;
+
+  int piece  = GET_PIECE(m);
+  int origin = GET_ORIGIN_SQ(m);
+  int dest   = GET_DEST_SQ(m);
+
+  int king_moved = piece == KING;
+
+  switch (GET_TYPE(m))
+  {
+    case MOVE_TYPE_SILENT:
+    case MOVE_TYPE_DOUBLE_PUSH:
+      if (king_moved) break;
+      removed[removed_count++] = (PieceDelta){side, piece, origin};
+      added[added_count++]     = (PieceDelta){side, piece, dest};
+      break;
+    case MOVE_TYPE_CAPTURE:
+      removed[removed_count++] = (PieceDelta){!side, GET_CAPTURED_PIECE(m), dest};
+      if (king_moved) break;
+      removed[removed_count++] = (PieceDelta){side, piece, origin};
+      added[added_count++]     = (PieceDelta){side, piece, dest};
+      break;
+    case MOVE_TYPE_EP:
+      removed[removed_count++] = (PieceDelta){!side, PAWN, side == WHITE ? dest - 8 : dest + 8};
+      removed[removed_count++] = (PieceDelta){side, PAWN, origin};
+      added[added_count++]     = (PieceDelta){side, PAWN, dest};
+      break;
+    case MOVE_TYPE_PROMOTION_WITH_CAPTURE:
+      removed[removed_count++] = (PieceDelta){!side, GET_CAPTURED_PIECE(m), dest};
+      // fall through
+    case MOVE_TYPE_PROMOTION:
+      removed[removed_count++] = (PieceDelta){side, PAWN, origin};
+      added[added_count++]     = (PieceDelta){side, GET_PROMOTION_PIECE(m), dest};
+      break;
+    case MOVE_TYPE_CASTLE_K:
+      king_moved               = 1;
+      removed[removed_count++] = (PieceDelta){side, ROOK, side == WHITE ? 7 : 63};
+      added[added_count++]     = (PieceDelta){side, ROOK, side == WHITE ? 5 : 61};
+      break;
+    case MOVE_TYPE_CASTLE_Q:
+      king_moved               = 1;
+      removed[removed_count++] = (PieceDelta){side, ROOK, side == WHITE ? 0 : 56};
+      added[added_count++]     = (PieceDelta){side, ROOK, side == WHITE ? 3 : 59};
+      break;
+  }
+
+  for (int perspective = 0; perspective < 2; perspective++)
+  {
+    // Every feature depends on the king square, so a king move changes all of them
+    if (king_moved && perspective == side)
+    {
+      refreshPerspective(b, perspective);
+      continue;
+    }
+
+    int king = BB_TO_SQ(b->piece[perspective][KING]);
+    int added_features[2], removed_features[2];
+
+    for (int i = 0; i < added_count; i++)
+      added_features[i] =
+          featureIndex(perspective, king, added[i].side, added[i].piece, added[i].sq);
+    for (int i = 0; i < removed_count; i++)
+      removed_features[i] =
+          featureIndex(perspective, king, removed[i].side, removed[i].piece, removed[i].sq);
+
+    if (undo)
+      updateAccumulator(
+          b->nnue.values[perspective], removed_features, removed_count, added_features, added_count
+      );
+    else
+      updateAccumulator(
+          b->nnue.values[perspective], added_features, added_count, removed_features, removed_count
+      );
+  }
+}
+
+// Clipped ReLU of an accumulator, [0, 127]
+static void clipAccumulator(short *acc, unsigned char *out)
+{
+#if defined(__AVX2__)
+  for (int i = 0; i < NNUE_HIDDEN; i += 32)
+  {
+    __m256i packed = _mm256_packs_epi16(
+        _mm256_loadu_si256((__m256i *)(acc + i)), _mm256_loadu_si256((__m256i *)(acc + i + 16))
+    );
+    packed = _mm256_max_epi8(packed, _mm256_setzero_si256());
+    // Packing works within 128-bit lanes, put the 64-bit quarters back in order
+    packed = _mm256_permute4x64_epi64(packed, 0xd8);
+
+    _mm256_storeu_si256((__m256i *)(out + i), packed);
+  }
+#elif defined(__SSE4_1__)
+  for (int i = 0; i < NNUE_HIDDEN; i += 16)
+  {
+    __m128i packed = _mm_packs_epi16(
+        _mm_loadu_si128((__m128i *)(acc + i)), _mm_loadu_si128((__m128i *)(acc + i + 8))
+    );
+    packed = _mm_max_epi8(packed, _mm_setzero_si128());
+
+    _mm_storeu_si128((__m128i *)(out + i), packed);
+  }
+#else
+  for (int i = 0; i < NNUE_HIDDEN; i++) out[i] = acc[i] < 0 ? 0 : acc[i] > 127 ? 127 : acc[i];
+#endif
+}
+
+// Inputs are in [0, 127], so the 16-bit pair sums of the SIMD paths can't saturate. The length
+// must be a multiple of 32.
+static int dot(unsigned char *in, signed char *weights, int length)
+{
+#if defined(__AVX2__)
+  __m256i sum  = _mm256_setzero_si256();
+  __m256i ones = _mm256_set1_epi16(1);
+
+  for (int i = 0; i < length; i += 32)
+  {
+    __m256i products = _mm256_maddubs_epi16(
+        _mm256_loadu_si256((__m256i *)(in + i)), _mm256_loadu_si256((__m256i *)(weights + i))
+    );
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(products, ones));
+  }
+
+  __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  sum128         = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0x4e));
+  sum128         = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0xb1));
+
+  return _mm_cvtsi128_si32(sum128);
+#elif defined(__SSE4_1__)
+  __m128i sum  = _mm_setzero_si128();
+  __m128i ones = _mm_set1_epi16(1);
+
+  for (int i = 0; i < length; i += 16)
+  {
+    __m128i products = _mm_maddubs_epi16(
+        _mm_loadu_si128((__m128i *)(in + i)), _mm_loadu_si128((__m128i *)(weights + i))
+    );
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(products, ones));
+  }
+
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+
+  return _mm_cvtsi128_si32(sum);
+#else
+  int sum = 0;
+  for (int i = 0; i < length; i++) sum += in[i] * weights[i];
+  return sum;
+#endif
+}
+
+// Dense layer followed by a clipped ReLU
+static void hiddenLayer(
+    unsigned char *in,
+    int            in_length,
+    signed char   *weights,
+    int           *biases,
+    unsigned char *out,
+    int            out_length
+)
+{
+  for (int i = 0; i < out_length; i++)
+  {
+    int value = (biases[i] + dot(in, weights + i * in_length, in_length)) >> NNUE_WEIGHT_SHIFT;
+    out[i]    = value < 0 ? 0 : value > 127 ? 127 : value;
+  }
+}
+
+// Score from the side to move's point of view, its perspective comes first in the input
+int NNUEEvaluate(Board *b)
+{
+  unsigned char input[2 * NNUE_HIDDEN];
+  unsigned char l1_out[NNUE_L1];
+  unsigned char l2_out[NNUE_L2];
+
+  clipAccumulator(b->nnue.values[b->turn], input);
+  clipAccumulator(b->nnue.values[!b->turn], input + NNUE_HIDDEN);
+
+  hiddenLayer(input, 2 * NNUE_HIDDEN, &l1_weights[0][0], l1_biases, l1_out, NNUE_L1);
+  hiddenLayer(l1_out, NNUE_L1, &l2_weights[0][0], l2_biases, l2_out, NNUE_L2);
+
+  return (out_bias + dot(l2_out, out_weights, NNUE_L2)) / NNUE_OUTPUT_SCALE;
+}
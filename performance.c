@@ -1,111 +1,375 @@
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "main.h"
 
-static void perft(Board *b, int depth, PerftResult *result)
+#define MAX_PERFT_THREADS 256
+
+#define PERFT_HASH_LOCKS 4096
+
+typedef struct
 {
-  if (depth == 0) return;
+  Board *root;
+  int    depth;
+  int    stats;  // Count move types, checks and mates, otherwise only the nodes
 
   Move move_list[MAX_MOVES];
   int  move_count;
 
-  Generate(b, b->turn, GEN_ALL, move_list, &move_count);
+  // Per root move results, filled by whichever worker searched the move
+  PerftResult move_results[MAX_MOVES];
 
-  for (int i = 0; i < move_count; i++)
+  int             next_move;
+  pthread_mutex_t lock;
+} PerftTask;
+
+typedef struct
+{
+  BB          hash;
+  int         depth;
+  int         stats;
+  PerftResult result;
+} PerftHashEntry;
+
+typedef struct
+{
+  PerftTask  *task;
+  PerftResult result;
+  double      time;
+} PerftWorker;
+
+// Subtree counts shared by all perft workers, every lock guards a stripe of entries
+static PerftHashEntry *perft_hash      = NULL;
+static size_t          perft_hash_size = 0;
+static pthread_mutex_t perft_hash_locks[PERFT_HASH_LOCKS];
+
+static double wallTime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Counts a leaf move, called after the move is made
+static void countMove(Board *b, Move m, PerftResult *result)
+{
+  result->total++;
+  switch (GET_TYPE(m))
   {
-    MakeMove(b, move_list[i]);
+    case MOVE_TYPE_EP:
+      result->eps++;
+      result->captures++;
+      break;
+    case MOVE_TYPE_CASTLE_K:
+      result->castles++;
+      break;
+    case MOVE_TYPE_CASTLE_Q:
+      result->castles++;
+      break;
+    case MOVE_TYPE_CAPTURE:
+      result->captures++;
+      break;
+    case MOVE_TYPE_PROMOTION:
+      result->promotions++;
+      break;
+    case MOVE_TYPE_PROMOTION_WITH_CAPTURE:
+      result->promotions++;
+      result->captures++;
+      break;
+  }
 
-    if (!IsKingAttacked(b, !b->turn))
-    {
-      if (depth == 1)
-      {
-        result->total++;
-        switch (GET_TYPE(move_list[i]))
-        {
-          case MOVE_TYPE_EP:
-            result->eps++;
-            result->captures++;
-            break;
-          case MOVE_TYPE_CASTLE_K:
-            result->castles++;
-            break;
-          case MOVE_TYPE_CASTLE_Q:
-            result->castles++;
-            break;
-          case MOVE_TYPE_CAPTURE:
-            result->captures++;
-            break;
-          case MOVE_TYPE_PROMOTION:
-            result->promotions++;
-            break;
-          case MOVE_TYPE_PROMOTION_WITH_CAPTURE:
-            result->promotions++;
-            result->captures++;
-            break;
-        }
-      }
-      perft(b, depth - 1, result);
-    }
-    UnmakeMove(b);
+  int king     = BB_TO_SQ(b->piece[b->turn][KING]);
+  BB  checkers = AttackersTo(b, !b->turn, king, b->all_pieces);
+
+  if (checkers == 0) return;
+
+  // The square of the piece that moved, for castles it's the rook
+  BB moved_bb;
+  switch (GET_TYPE(m))
+  {
+    case MOVE_TYPE_CASTLE_K:
+      moved_bb = b->turn == WHITE ? SQ_TO_BB(61) : SQ_TO_BB(5);
+      break;
+    case MOVE_TYPE_CASTLE_Q:
+      moved_bb = b->turn == WHITE ? SQ_TO_BB(59) : SQ_TO_BB(3);
+      break;
+    default:
+      moved_bb = SQ_TO_BB(GET_DEST_SQ(m));
+      break;
   }
+
+  // Like in the published perft tables, double checks are not counted as discovery checks
+  result->checks++;
+  if ((checkers & (checkers - 1)) != 0)
+    result->double_checks++;
+  else if ((checkers & ~moved_bb) != 0)
+    result->discovery_checks++;
+
+  // Mates are only looked for in checked positions, which are a small fraction of the leaves
+  Move move_list[MAX_MOVES];
+  int  move_count;
+
+  Generate(b, b->turn, GEN_ALL | GEN_LEGAL, move_list, &move_count);
+  if (move_count == 0) result->checkmates++;
 }
 
-void RunPerft(Board *b, int depth)
+static void addResult(PerftResult *to, PerftResult *from)
 {
-  PerftResult result;
-  memset(&result, 0, sizeof(PerftResult));
-
-  clock_t start = clock();
-  perft(b, depth, &result);
-  printf(
-      "Perft(%d):\ntotal:%d\neps:%d\ncaptures:%d\ncastles:%d\npromotions:%d\n\n\n",
-      depth,
-      result.total,
-      result.eps,
-      result.captures,
-      result.castles,
-      result.promotions
-  );
-  clock_t end = clock();
-
-  double time = (double)(end - start) / CLOCKS_PER_SEC;
-  long   nps  = result.total / time;
+  to->total += from->total;
+  to->eps += from->eps;
+  to->castles += from->castles;
+  to->promotions += from->promotions;
+  to->captures += from->captures;
+  to->checks += from->checks;
+  to->discovery_checks += from->discovery_checks;
+  to->double_checks += from->double_checks;
+  to->checkmates += from->checkmates;
+}
 
-  printf("Nodes per second: %ld\n\n\n", nps);
+void SetPerftHash(int size_mb)
+{
+  if (perft_hash != NULL)
+  {
+    free(perft_hash);
+    for (int i = 0; i < PERFT_HASH_LOCKS; i++) pthread_mutex_destroy(&perft_hash_locks[i]);
+  }
+
+  perft_hash      = NULL;
+  perft_hash_size = 0;
+
+  if (size_mb <= 0) return;
+
+  size_t size = (size_t)size_mb * 1024 * 1024 / sizeof(PerftHashEntry);
+
+  perft_hash = calloc(size, sizeof(PerftHashEntry));
+  if (perft_hash == NULL)
+  {
+    printf("SetPerftHash - cannot allocate %d MB\n", size_mb);
+    return;
+  }
+  perft_hash_size = size;
+
+  for (int i = 0; i < PERFT_HASH_LOCKS; i++) pthread_mutex_init(&perft_hash_locks[i], NULL);
+}
+
+static int probePerftHash(BB hash, int depth, int stats, PerftResult *result)
+{
+  size_t           i     = hash % perft_hash_size;
+  pthread_mutex_t *lock  = &perft_hash_locks[i % PERFT_HASH_LOCKS];
+  int              found = 0;
+
+  pthread_mutex_lock(lock);
+  // Entries with full statistics can also answer node count only probes
+  if (perft_hash[i].hash == hash && perft_hash[i].depth == depth && perft_hash[i].stats >= stats)
+  {
+    *result = perft_hash[i].result;
+    found   = 1;
+  }
+  pthread_mutex_unlock(lock);
+
+  return found;
+}
+
+static void storePerftHash(BB hash, int depth, int stats, PerftResult *result)
+{
+  size_t           i    = hash % perft_hash_size;
+  pthread_mutex_t *lock = &perft_hash_locks[i % PERFT_HASH_LOCKS];
+
+  pthread_mutex_lock(lock);
+  perft_hash[i].hash   = hash;
+  perft_hash[i].depth  = depth;
+  perft_hash[i].stats  = stats;
+  perft_hash[i].result = *result;
+  pthread_mutex_unlock(lock);
 }
 
-void RunPerftDiv(Board *b, int depth)
+static void perft(Board *b, int depth, int stats, PerftResult *result);
+
+static void perftChildren(Board *b, int depth, int stats, PerftResult *result)
 {
   Move move_list[MAX_MOVES];
   int  move_count;
 
-  Generate(b, b->turn, GEN_ALL, move_list, &move_count);
+  Generate(b, b->turn, GEN_ALL | GEN_LEGAL, move_list, &move_count);
 
-  int total = 0;
+  // Bulk counting, the generated moves are legal so the leaves don't have to be made
+  if (depth == 1 && !stats)
+  {
+    result->total += move_count;
+    return;
+  }
 
   for (int i = 0; i < move_count; i++)
   {
     MakeMove(b, move_list[i]);
 
-    if (!SquareAttackedBy(b, b->turn, ffsll(b->piece[!b->turn][KING]) - 1))
-    {
-      PerftResult result;
-      memset(&result, 0, sizeof(PerftResult));
+    if (depth == 1) countMove(b, move_list[i], result);
+    perft(b, depth - 1, stats, result);
 
-      perft(b, depth - 1, &result);
+    UnmakeMove(b);
+  }
+}
 
-      total += result.total;
+static void perft(Board *b, int depth, int stats, PerftResult *result)
+{
+  if (depth == 0) return;
+
+  // Depth 1 subtrees are cheaper to count than to look up
+  if (perft_hash_size != 0 && depth >= 2)
+  {
+    PerftResult subtree;
 
-      char buff[6];
-      PrintMoveStr(buff, move_list[i]);
-      printf("%d - %s: %d\n", i, buff, result.total);
+    if (!probePerftHash(b->hash_value, depth, stats, &subtree))
+    {
+      memset(&subtree, 0, sizeof(PerftResult));
+      perftChildren(b, depth, stats, &subtree);
+      storePerftHash(b->hash_value, depth, stats, &subtree);
     }
 
-    UnmakeMove(b);
+    addResult(result, &subtree);
+  }
+  else
+    perftChildren(b, depth, stats, result);
+}
+
+static void *perftWorker(void *arg)
+{
+  PerftWorker *worker = arg;
+  PerftTask   *task   = worker->task;
+
+  // Every worker makes moves on its own copy of the root position
+  Board     b;
+  UndoStack undo;
+  memcpy(&b, task->root, sizeof(Board));
+  SetUndoStack(&b, &undo);
+
+  double start = wallTime();
+
+  for (;;)
+  {
+    pthread_mutex_lock(&task->lock);
+    int i = task->next_move++;
+    pthread_mutex_unlock(&task->lock);
+
+    if (i >= task->move_count) break;
+
+    PerftResult *result = &task->move_results[i];
+
+    MakeMove(&b, task->move_list[i]);
+    if (task->depth > 1)
+      perft(&b, task->depth - 1, task->stats, result);
+    else if (task->stats)
+      countMove(&b, task->move_list[i], result);
+    else
+      result->total++;
+    UnmakeMove(&b);
+
+    addResult(&worker->result, result);
+  }
+
+  worker->time = wallTime() - start;
+
+  return NULL;
+}
+
+// Splits the root moves between the threads, each move's subtree is counted by a single worker
+static double runPerftThreads(
+    Board *b, int depth, int threads, int stats, PerftTask *task, PerftResult *total
+)
+{
+  PerftWorker workers[MAX_PERFT_THREADS];
+  pthread_t   handles[MAX_PERFT_THREADS];
+
+  if (threads < 1) threads = 1;
+  if (threads > MAX_PERFT_THREADS) threads = MAX_PERFT_THREADS;
+
+  memset(task, 0, sizeof(PerftTask));
+  memset(workers, 0, sizeof(workers));
+  memset(total, 0, sizeof(PerftResult));
+
+  task->root  = b;
+  task->depth = depth;
+  task->stats = stats;
+  pthread_mutex_init(&task->lock, NULL);
+
+  double start = wallTime();
+
+  if (depth > 0) Generate(b, b->turn, GEN_ALL | GEN_LEGAL, task->move_list, &task->move_count);
+
+  for (int i = 0; i < threads; i++)
+  {
+    workers[i].task = task;
+    pthread_create(&handles[i], NULL, perftWorker, &workers[i]);
+  }
+  for (int i = 0; i < threads; i++)
+  {
+    pthread_join(handles[i], NULL);
+    addResult(total, &workers[i].result);
   }
 
-  printf("\nNodes searched: %d\n", total);
+  double time = wallTime() - start;
+
+  pthread_mutex_destroy(&task->lock);
+
+  printf("Threads: %d\n", threads);
+  for (int i = 0; i < threads; i++)
+    printf(
+        "Thread %d: %llu nodes, %ld nodes per second\n",
+        i,
+        workers[i].result.total,
+        workers[i].time > 0 ? (long)(workers[i].result.total / workers[i].time) : 0
+    );
+  printf("\n");
+
+  return time;
+}
+
+void RunPerft(Board *b, int depth, int threads, int stats)
+{
+  PerftTask   task;
+  PerftResult result;
+
+  double time = runPerftThreads(b, depth, threads, stats, &task, &result);
+
+  if (!stats)
+    printf("Perft(%d):\ntotal:%llu\n\n\n", depth, result.total);
+  else
+    printf(
+        "Perft(%d):\ntotal:%llu\neps:%llu\ncaptures:%llu\ncastles:%llu\npromotions:%llu\n"
+        "checks:%llu\ndiscovery checks:%llu\ndouble checks:%llu\ncheckmates:%llu\n\n\n",
+        depth,
+        result.total,
+        result.eps,
+        result.captures,
+        result.castles,
+        result.promotions,
+        result.checks,
+        result.discovery_checks,
+        result.double_checks,
+        result.checkmates
+    );
+
+  long nps = result.total / time;
+
+  printf("Nodes per second: %ld\n\n\n", nps);
 }
 
+void RunPerftDiv(Board *b, int depth, int threads, int stats)
+{
+  PerftTask   task;
+  PerftResult result;
+
+  runPerftThreads(b, depth, threads, stats, &task, &result);
+
+  for (int i = 0; i < task.move_count; i++)
+  {
+    char buff[6];
+    PrintMoveStr(buff, task.move_list[i]);
+    printf("%d - %s: %llu\n", i, buff, task.move_results[i].total);
+  }
+
+  printf("\nNodes searched: %llu\n", result.total);
+}
@@ -0,0 +1,54 @@
+#include "main.h"
+
+#ifdef USE_PEXT
+
+// Sums of the blocker subset counts over all squares
+#define ROOK_TABLE_SIZE   102400
+#define BISHOP_TABLE_SIZE 5248
+
+static BB rook_table[ROOK_TABLE_SIZE];
+static BB bishop_table[BISHOP_TABLE_SIZE];
+
+const BB *pext_rook_attacks[64];
+const BB *pext_bishop_attacks[64];
+
+// PEXT of the blocker mask indexes the subsets densely, so every square needs only
+// 2^(blocker bits) entries. The attacks are taken from the magic tables, which hold every subset.
+void InitSliderAttacks()
+{
+  BB *rook   = rook_table;
+  BB *bishop = bishop_table;
+
+  for (int sq = 0; sq < 64; sq++)
+  {
+    BB mask     = precomp_rook_blocker_mask[sq];
+    BB blockers = 0;
+
+    pext_rook_attacks[sq] = rook;
+    do
+    {
+      rook[_pext_u64(blockers, mask)] = precomp_rook_moves[ROOK_MAGIC_INDEX(sq, blockers)];
+      blockers                        = (blockers - mask) & mask;
+    } while (blockers != 0);
+    rook += 1ULL << POPCOUNT(mask);
+
+    mask     = precomp_bishop_blocker_mask[sq];
+    blockers = 0;
+
+    pext_bishop_attacks[sq] = bishop;
+    do
+    {
+      bishop[_pext_u64(blockers, mask)] =
+          precomp_bishop_moves[BISHOP_MAGIC_INDEX(sq, blockers)];
+      blockers = (blockers - mask) & mask;
+    } while (blockers != 0);
+    bishop += 1ULL << POPCOUNT(mask);
+  }
+}
+
+#else
+
+// Magic bitboard tables are precomputed
+void InitSliderAttacks() {}
+
+#endif
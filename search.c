@@ -1,5 +1,11 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "main.h"
 
@@ -10,187 +16,753 @@
 #define IS_WIN_MATE(s)  ((s) >= MIN_MATE_SCORE && (s) <= MATE_SCORE)
 #define IS_LOSE_MATE(s) ((s) <= -MIN_MATE_SCORE && (s) >= -MATE_SCORE)
 
-#define TT_SIZE (1024)
+#define TT_DEFAULT_SIZE_MB 16
+#define TT_BUCKET_ENTRIES  5
+#define TT_AGE_MASK        0x3f
+
+#define EVAL_CACHE_SIZE 65536  // Entries per search thread, a power of 2
+
+#define HUGE_PAGE_SIZE    (2 * 1024 * 1024)
+#define MAX_CLEAR_THREADS 64
+
+#define MAX_SEARCH_THREADS 256
+#define MAX_DEPTH          20
+
+// Initial half-width of the aspiration window around the previous iteration's score
+#define ASPIRATION_WINDOW 50
+
+// How often (in nodes) the main thread checks the search limits
+#define LIMITS_CHECK_INTERVAL 1024
+
+// Time management (ms)
+#define MOVE_OVERHEAD      30
+#define DEFAULT_MOVESTOGO  40
+#define MAX_STABILITY      5
 
 #define TTENTRY_EXACT      0
 #define TTENTRY_LOWERBOUND 1
 #define TTENTRY_UPPERBOUND 2
 
+// Flags of moves packed to 16 bits (origin, destination, promotion piece, flag)
+#define PACKED_NORMAL    0
+#define PACKED_PROMOTION 1
+#define PACKED_CASTLE_K  2
+#define PACKED_CASTLE_Q  3
+
+// Move picker stages, every stage is entered only if the previous ones didn't cause a cutoff
+#define STAGE_PV_MOVE      0
+#define STAGE_TT_MOVE      1
+#define STAGE_GEN_CAPTURES 2
+#define STAGE_CAPTURES     3  // Captures that don't lose material
+#define STAGE_REFUTATIONS  4  // Killers and the counter move
+#define STAGE_GEN_QUIETS   5
+#define STAGE_QUIETS       6
+#define STAGE_BAD_CAPTURES 7
+#define STAGE_DONE         8
+
+#define KILLER_SLOTS 2
+#define REFUTATIONS  (KILLER_SLOTS + 1)
+
+// History scores are kept in [-HISTORY_MAX, HISTORY_MAX] by scaling every update with the
+// distance to the limit, so old entries fade as new ones are added
+#define HISTORY_MAX 16384
+
+// Entries are shared by the search threads without locks. The key is stored XORed with the
+// rest of the entry, so an entry torn by concurrent writes fails the key check.
 typedef struct
 {
-  BB            hash;
-  Move          best_move;
-  Move          moves[MAX_MOVES];
-  int           moves_count;
-  int           score;
-  unsigned char occupied;
-  unsigned char depth;
-  unsigned char entry_type;
+  unsigned int   key;  // Upper half of the hash, the lower half selects the bucket
+  int            score;
+  unsigned short move;
+  unsigned char  depth;
+  unsigned char  flags;  // Entry type in the lowest 2 bits, search age in the rest
 } TTEntry;
 
-TTEntry tt[TT_SIZE];
+// Static evaluations of recently seen positions, owned by a single thread and overwritten freely
+typedef struct
+{
+  unsigned int key;  // Upper half of the hash, the lower half selects the entry
+  int          eval;
+} EvalCacheEntry;
+
+// One cache line
+typedef struct
+{
+  TTEntry entries[TT_BUCKET_ENTRIES];
+  char    padding[64 - TT_BUCKET_ENTRIES * sizeof(TTEntry)];
+} TTBucket;
 
-static void printVariation(Variation *variation)
+typedef struct
 {
-  for (int i = 0; i < variation->plies_count; i++)
+  char  *start;
+  size_t length;
+} ClearTask;
+
+typedef struct
+{
+  int  stage;
+  int  captures_only;
+  Move pv_move;
+  Move tt_move;
+
+  Move refutations[REFUTATIONS];
+  int  next_refutation;
+
+  int (*history)[64];  // Butterfly history of the side to move
+
+  Move moves[MAX_MOVES];
+  int  scores[MAX_MOVES];
+  int  moves_count;
+  int  next;
+
+  // Captures losing material by SEE, searched after the quiet moves (dropped in quiescence)
+  Move bad_captures[MAX_MOVES];
+  int  bad_captures_count;
+  int  next_bad_capture;
+} MovePicker;
+
+// State owned by a single search thread
+typedef struct
+{
+  int           id;
+  Board         board;
+  Variation     previous_pv;
+  Variation     pv;
+  int           score;
+  int           depth;  // Last completed iteration
+  atomic_ullong nodes;  // Written only by the owner, read by the main thread
+
+  // Quiet move ordering, filled by beta cutoffs
+  Move killers[MAX_PLY][KILLER_SLOTS];  // Per ply
+  int  history[2][64][64];              // Side, origin, destination
+  Move counter_moves[64][64];           // Origin and destination of the opponent's last move
+
+  UndoStack      undo;
+  PawnTable      pawn_table;
+  EvalCacheEntry eval_cache[EVAL_CACHE_SIZE];
+} SearchThread;
+
+static TTBucket     *tt         = NULL;
+static size_t        tt_size    = 0;
+static size_t        tt_bytes   = 0;  // Allocated size, rounded up to whole huge pages
+static int           tt_mmapped = 0;
+static unsigned char tt_age     = 0;
+
+static int        search_threads = 1;
+static atomic_int search_stop;
+
+static SearchLimits  search_limits;
+static SearchThread *search_thread_data;
+static double        search_start;
+static int           search_hard_limit;  // ms, the search is stopped immediately after it
+static int           search_soft_limit;  // ms, no new iteration is started after it
+
+// Piece values for MVV-LVA ordering, a king can only capture undefended pieces
+static const int mvv_lva_value[6] = {1, 3, 5, 9, 3, 0};
+
+// Share of the soft limit used, depending on how many iterations the best move hasn't changed
+static const double stability_scale[MAX_STABILITY + 1] = {1.6, 1.25, 1.0, 0.85, 0.7, 0.6};
+
+// Huge pages cut the TLB misses of random probes, explicit ones are tried first, then
+// transparent huge pages
+static void *allocHash(size_t bytes)
+{
+#ifdef MAP_HUGETLB
+  void *mem =
+      mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED)
   {
-    char buff[6];
-    PrintMoveStr(buff, variation->plies[i]);
-    printf("%s ", buff);
+    tt_mmapped = 1;
+    return mem;
   }
+#endif
+
+  tt_mmapped = 0;
+
+  void *aligned = aligned_alloc(HUGE_PAGE_SIZE, bytes);
+#ifdef MADV_HUGEPAGE
+  if (aligned != NULL) madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+  return aligned;
+}
+
+static void freeHash()
+{
+  if (tt == NULL) return;
+
+  if (tt_mmapped)
+    munmap(tt, tt_bytes);
+  else
+    free(tt);
+
+  tt = NULL;
 }
 
-int Evaluate(Board *b)
+void SetHashSize(int size_mb)
 {
-  int who2move[2] = {1, -1};
+  freeHash();
+
+  tt_size = (size_t)size_mb * 1024 * 1024 / sizeof(TTBucket);
+  if (tt_size == 0) tt_size = 1;
 
-  int total = 0;
+  tt_bytes = (tt_size * sizeof(TTBucket) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
 
-  for (int i = 0; i < 5; i++) total += GetTotalMaterial(b, WHITE) - GetTotalMaterial(b, BLACK);
+  tt = allocHash(tt_bytes);
+  if (tt == NULL)
+  {
+    printf("SetHashSize - cannot allocate %d MB\n", size_mb);
+    tt_size = 0;
+    return;
+  }
 
-  return total * who2move[b->turn];
+  ClearHash();
 }
 
-static void orderMoves(Move *moves, int moves_count, Move pv_move, Move best_move, int j)
+static void *clearWorker(void *arg)
 {
-  const int pv_move_score   = 9999999;
-  const int best_move_score = 8888888;
+  ClearTask *task = arg;
+  memset(task->start, 0, task->length);
+  return NULL;
+}
+
+// Clearing also faults the pages in, which is spread over all cores for big tables
+void ClearHash()
+{
+  if (tt == NULL) return;
+
+  ClearTask tasks[MAX_CLEAR_THREADS];
+  pthread_t handles[MAX_CLEAR_THREADS];
+
+  size_t bytes = tt_size * sizeof(TTBucket);
 
-  int best_order_score = -pv_move_score;
-  int best_i           = j;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > MAX_CLEAR_THREADS) threads = MAX_CLEAR_THREADS;
+  if (threads < 1 || bytes < HUGE_PAGE_SIZE) threads = 1;
 
-  for (int i = j; i < moves_count; i++)
+  size_t chunk = (bytes / threads + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+  for (int i = 0; i < threads; i++)
   {
-    int order_score;
+    size_t start = chunk * i;
 
-    if (moves[i] == pv_move)
-      order_score = pv_move_score;
-    else if (moves[i] == best_move)
-      order_score = best_move_score;
-    else
+    tasks[i].start  = (char *)tt + start;
+    tasks[i].length = start >= bytes ? 0 : (bytes - start < chunk ? bytes - start : chunk);
+
+    pthread_create(&handles[i], NULL, clearWorker, &tasks[i]);
+  }
+  for (int i = 0; i < threads; i++) pthread_join(handles[i], NULL);
+
+  tt_age = 0;
+}
+
+static unsigned short packMove(Move m)
+{
+  switch (GET_TYPE(m))
+  {
+    case MOVE_TYPE_CASTLE_K:
+      return PACKED_CASTLE_K << 14;
+    case MOVE_TYPE_CASTLE_Q:
+      return PACKED_CASTLE_Q << 14;
+    case MOVE_TYPE_PROMOTION:
+    case MOVE_TYPE_PROMOTION_WITH_CAPTURE:
+      return GET_ORIGIN_SQ(m) | (GET_DEST_SQ(m) << 6) | ((GET_PROMOTION_PIECE(m) - 1) << 12) |
+             (PACKED_PROMOTION << 14);
+    default:
+      return GET_ORIGIN_SQ(m) | (GET_DEST_SQ(m) << 6);
+  }
+}
+
+// The pieces of the packed move are taken from the board, the result still has to be verified
+static Move unpackMove(Board *b, unsigned short packed)
+{
+  if (packed == 0) return NULL_MOVE;
+
+  switch (packed >> 14)
+  {
+    case PACKED_CASTLE_K:
+      return CREATE_MOVE(0, 0, 0, 0, KING, MOVE_TYPE_CASTLE_K);
+    case PACKED_CASTLE_Q:
+      return CREATE_MOVE(0, 0, 0, 0, KING, MOVE_TYPE_CASTLE_Q);
+  }
+
+  int origin   = packed & 0x3f;
+  int dest     = (packed >> 6) & 0x3f;
+  int piece    = b->mailbox[origin];
+  int captured = b->mailbox[dest];
+
+  if (piece == PIECE_NONE) return NULL_MOVE;
+
+  if ((packed >> 14) == PACKED_PROMOTION)
+  {
+    int promotion = ((packed >> 12) & 3) + 1;
+
+    if (captured == PIECE_NONE)
+      return CREATE_MOVE(origin, dest, 0, promotion, piece, MOVE_TYPE_PROMOTION);
+    return CREATE_MOVE(origin, dest, captured, promotion, piece, MOVE_TYPE_PROMOTION_WITH_CAPTURE);
+  }
+
+  if (captured != PIECE_NONE)
+    return CREATE_MOVE(origin, dest, captured, 0, piece, MOVE_TYPE_CAPTURE);
+
+  if (piece == PAWN)
+  {
+    if ((origin ^ dest) == 16) return CREATE_MOVE(origin, dest, 0, 0, PAWN, MOVE_TYPE_DOUBLE_PUSH);
+    if ((origin & 7) != (dest & 7)) return CREATE_MOVE(origin, dest, PAWN, 0, PAWN, MOVE_TYPE_EP);
+  }
+
+  return CREATE_MOVE(origin, dest, 0, 0, piece, MOVE_TYPE_SILENT);
+}
+
+static unsigned int ttEntryKey(TTEntry *entry)
+{
+  return entry->key ^ entry->score ^
+         (entry->move | (entry->depth << 16) | ((unsigned int)entry->flags << 24));
+}
+
+// The entry is copied before it's verified, it can be overwritten by other threads at any time
+static int ttProbe(BB hash, TTEntry *entry)
+{
+  TTBucket    *bucket = tt + (hash & 0xffffffff) % tt_size;
+  unsigned int key    = hash >> 32;
+
+  for (int i = 0; i < TT_BUCKET_ENTRIES; i++)
+  {
+    *entry = bucket->entries[i];
+    if (ttEntryKey(entry) == key && entry->depth != 0) return 1;
+  }
+
+  return 0;
+}
+
+// Entries from older searches are worth less than their depth suggests
+static int ttReplaceValue(TTEntry *entry)
+{
+  return entry->depth - 8 * ((tt_age - (entry->flags >> 2)) & TT_AGE_MASK);
+}
+
+static void ttStore(BB hash, Move move, int score, int depth, int entry_type)
+{
+  TTBucket    *bucket = tt + (hash & 0xffffffff) % tt_size;
+  unsigned int key    = hash >> 32;
+
+  TTEntry *replace = &bucket->entries[0];
+
+  for (int i = 0; i < TT_BUCKET_ENTRIES; i++)
+  {
+    TTEntry *entry = &bucket->entries[i];
+
+    if (ttEntryKey(entry) == key)
     {
-      switch (GET_TYPE(moves[i]))
+      replace = entry;
+      break;
+    }
+    if (ttReplaceValue(entry) < ttReplaceValue(replace)) replace = entry;
+  }
+
+  TTEntry new_entry;
+
+  // Don't lose the best move of the same position when storing a fail low
+  if (move != NULL_MOVE || ttEntryKey(replace) != key)
+    new_entry.move = packMove(move);
+  else
+    new_entry.move = replace->move;
+
+  new_entry.score = score;
+  new_entry.depth = depth;
+  new_entry.flags = entry_type | (tt_age << 2);
+  new_entry.key   = 0;
+  new_entry.key   = key ^ ttEntryKey(&new_entry);
+
+  *replace = new_entry;
+}
+
+static void printVariation(Variation *variation, int side)
+{
+  for (int i = 0; i < variation->plies_count; i++)
+  {
+    char buff[6];
+    PrintMoveUCI(buff, variation->plies[i], side ^ (i & 1));
+    printf(" %s", buff);
+  }
+}
+
+static int captureScore(Move m)
+{
+  int score = 0;
+
+  switch (GET_TYPE(m))
+  {
+    case MOVE_TYPE_PROMOTION_WITH_CAPTURE:
+      score = 16 * mvv_lva_value[GET_PROMOTION_PIECE(m)];
+      // fall through
+    case MOVE_TYPE_CAPTURE:
+    case MOVE_TYPE_EP:
+      return score + 16 * mvv_lva_value[GET_CAPTURED_PIECE(m)] - mvv_lva_value[GET_PIECE(m)];
+    case MOVE_TYPE_PROMOTION:
+      return 16 * mvv_lva_value[GET_PROMOTION_PIECE(m)];
+  }
+
+  return 0;
+}
+
+static int isQuiet(Move m)
+{
+  switch (GET_TYPE(m))
+  {
+    case MOVE_TYPE_SILENT:
+    case MOVE_TYPE_DOUBLE_PUSH:
+    case MOVE_TYPE_CASTLE_K:
+    case MOVE_TYPE_CASTLE_Q:
+      return 1;
+  }
+  return 0;
+}
+
+static int isHashMove(MovePicker *mp, Move m) { return m == mp->pv_move || m == mp->tt_move; }
+
+static int isRefutation(MovePicker *mp, Move m)
+{
+  for (int i = 0; i < REFUTATIONS; i++)
+    if (mp->refutations[i] == m) return 1;
+  return 0;
+}
+
+// The pv and tt moves must be legal in the position, they are returned without generating.
+// Killers and the counter move are verified only when their stage is reached.
+static void initMovePicker(
+    MovePicker *mp,
+    Move        pv_move,
+    Move        tt_move,
+    Move        killers[],
+    Move        counter_move,
+    int (*history)[64]
+)
+{
+  mp->stage           = STAGE_PV_MOVE;
+  mp->captures_only   = 0;
+  mp->pv_move         = pv_move;
+  mp->tt_move         = tt_move != pv_move ? tt_move : NULL_MOVE;
+  mp->next_refutation = 0;
+  mp->history         = history;
+  mp->moves_count     = 0;
+  mp->next            = 0;
+
+  mp->bad_captures_count = 0;
+  mp->next_bad_capture   = 0;
+
+  for (int i = 0; i < KILLER_SLOTS; i++) mp->refutations[i] = killers[i];
+  mp->refutations[KILLER_SLOTS] = counter_move;
+
+  // Duplicates would be searched twice
+  for (int i = 0; i < REFUTATIONS; i++)
+  {
+    if (isHashMove(mp, mp->refutations[i])) mp->refutations[i] = NULL_MOVE;
+    for (int j = 0; j < i; j++)
+      if (mp->refutations[j] == mp->refutations[i]) mp->refutations[i] = NULL_MOVE;
+  }
+}
+
+static void initCapturePicker(MovePicker *mp)
+{
+  mp->stage         = STAGE_GEN_CAPTURES;
+  mp->captures_only = 1;
+  mp->pv_move       = NULL_MOVE;
+  mp->tt_move       = NULL_MOVE;
+  mp->moves_count   = 0;
+  mp->next          = 0;
+
+  mp->bad_captures_count = 0;
+  mp->next_bad_capture   = 0;
+}
+
+// Selection of the best scored move that is left, the lists are short and usually a cutoff
+// happens after the first few moves
+static Move pickBestMove(MovePicker *mp)
+{
+  int best_i = mp->next;
+
+  for (int i = mp->next + 1; i < mp->moves_count; i++)
+    if (mp->scores[i] > mp->scores[best_i]) best_i = i;
+
+  Move best       = mp->moves[best_i];
+  int  best_score = mp->scores[best_i];
+
+  mp->moves[best_i]    = mp->moves[mp->next];
+  mp->scores[best_i]   = mp->scores[mp->next];
+  mp->moves[mp->next]  = best;
+  mp->scores[mp->next] = best_score;
+
+  return mp->moves[mp->next++];
+}
+
+// Returns the next move to search or NULL_MOVE when all moves were returned
+static Move nextMove(MovePicker *mp, Board *b)
+{
+  Move m;
+
+  switch (mp->stage)
+  {
+    case STAGE_PV_MOVE:
+      mp->stage = STAGE_TT_MOVE;
+      if (mp->pv_move != NULL_MOVE) return mp->pv_move;
+      // fall through
+    case STAGE_TT_MOVE:
+      mp->stage = STAGE_GEN_CAPTURES;
+      if (mp->tt_move != NULL_MOVE) return mp->tt_move;
+      // fall through
+    case STAGE_GEN_CAPTURES:
+      Generate(b, b->turn, GEN_ATTACKS | GEN_PROMOTIONS | GEN_LEGAL, mp->moves, &mp->moves_count);
+      for (int i = 0; i < mp->moves_count; i++) mp->scores[i] = captureScore(mp->moves[i]);
+      mp->next  = 0;
+      mp->stage = STAGE_CAPTURES;
+      // fall through
+    case STAGE_CAPTURES:
+      while (mp->next < mp->moves_count)
       {
-        case MOVE_TYPE_EP:
-          order_score = GET_CAPTURED_PIECE(moves[i]) - 1;
-          break;
-        case MOVE_TYPE_CAPTURE:
-          order_score = GET_CAPTURED_PIECE(moves[i]) - GET_PIECE(moves[i]);
-          break;
-        case MOVE_TYPE_PROMOTION:
-          order_score = GET_PROMOTION_PIECE(moves[i]) - 1;
-          break;
-        case MOVE_TYPE_PROMOTION_WITH_CAPTURE:
-          order_score = GET_PROMOTION_PIECE(moves[i]) + GET_CAPTURED_PIECE(moves[i]) -
-                        GET_PIECE(moves[i]) - 1;
-          break;
-        default:
-          order_score = -100;
-          break;
+        m = pickBestMove(mp);
+        if (isHashMove(mp, m)) continue;
+
+        // Taking a piece worth at least the capturing one can't lose material, SEE is needed only
+        // for the rest
+        if (mvv_lva_value[GET_CAPTURED_PIECE(m)] < mvv_lva_value[GET_PIECE(m)] && SEE(b, m) < 0)
+        {
+          if (!mp->captures_only) mp->bad_captures[mp->bad_captures_count++] = m;
+          continue;
+        }
+
+        return m;
       }
-    }
+      if (mp->captures_only)
+      {
+        mp->stage = STAGE_DONE;
+        return NULL_MOVE;
+      }
+      mp->stage = STAGE_REFUTATIONS;
+      // fall through
+    case STAGE_REFUTATIONS:
+      while (mp->next_refutation < REFUTATIONS)
+      {
+        m = mp->refutations[mp->next_refutation++];
+        if (m != NULL_MOVE && isQuiet(m) && IsValidMove(b, m)) return m;
+      }
+      mp->stage = STAGE_GEN_QUIETS;
+      // fall through
+    case STAGE_GEN_QUIETS:
+      Generate(b, b->turn, GEN_SILENT | GEN_LEGAL, mp->moves, &mp->moves_count);
+      for (int i = 0; i < mp->moves_count; i++)
+        mp->scores[i] = mp->history[GET_ORIGIN_SQ(mp->moves[i])][GET_DEST_SQ(mp->moves[i])];
+      mp->next  = 0;
+      mp->stage = STAGE_QUIETS;
+      // fall through
+    case STAGE_QUIETS:
+      while (mp->next < mp->moves_count)
+      {
+        m = pickBestMove(mp);
+        if (!isHashMove(mp, m) && !isRefutation(mp, m)) return m;
+      }
+      mp->stage = STAGE_BAD_CAPTURES;
+      // fall through
+    case STAGE_BAD_CAPTURES:
+      if (mp->next_bad_capture < mp->bad_captures_count)
+        return mp->bad_captures[mp->next_bad_capture++];
+      mp->stage = STAGE_DONE;
+  }
 
-    if (order_score > best_order_score)
-    {
-      best_order_score = order_score;
-      best_i           = i;
-    }
+  return NULL_MOVE;
+}
+
+static void updateHistory(int *entry, int bonus)
+{
+  *entry += bonus - *entry * abs(bonus) / HISTORY_MAX;
+}
+
+// A quiet move caused a beta cutoff, the quiet moves searched before it failed to
+static void updateQuietOrdering(
+    SearchThread *t, Move move, Move tried[], int tried_count, int depthleft
+)
+{
+  Board *b   = &t->board;
+  int    ply = b->undo->count;
+
+  if (t->killers[ply][0] != move)
+  {
+    for (int i = KILLER_SLOTS - 1; i > 0; i--) t->killers[ply][i] = t->killers[ply][i - 1];
+    t->killers[ply][0] = move;
   }
-  Move tmp      = moves[j];
-  moves[j]      = moves[best_i];
-  moves[best_i] = tmp;
+
+  if (ply > 0 && b->undo->records[ply - 1].move != NULL_MOVE)
+  {
+    Move previous = b->undo->records[ply - 1].move;
+    t->counter_moves[GET_ORIGIN_SQ(previous)][GET_DEST_SQ(previous)] = move;
+  }
+
+  int bonus = depthleft * depthleft;
+  if (bonus > HISTORY_MAX / 4) bonus = HISTORY_MAX / 4;
+
+  int(*history)[64] = t->history[b->turn];
+
+  updateHistory(&history[GET_ORIGIN_SQ(move)][GET_DEST_SQ(move)], bonus);
+  for (int i = 0; i < tried_count; i++)
+    updateHistory(&history[GET_ORIGIN_SQ(tried[i])][GET_DEST_SQ(tried[i])], -bonus);
 }
 
-static int isPv(Variation *pv, Variation *variation)
+// Whether the moves made since the root follow the variation
+static int isPv(Variation *pv, UndoStack *undo)
 {
-  if (variation->plies_count > pv->plies_count + 1) return 0;
+  if (undo->count > pv->plies_count + 1) return 0;
 
-  for (int i = 0; i < variation->plies_count; i++)
-    if (variation->plies[i] != pv->plies[i]) return 0;
+  for (int i = 0; i < undo->count; i++)
+    if (undo->records[i].move != pv->plies[i]) return 0;
   return 1;
 }
 
-static int quiesce(Board *b, int alpha, int beta)
+static double wallTime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long totalNodes()
 {
-  int static_eval = Evaluate(b);
+  unsigned long long nodes = 0;
+
+  for (int i = 0; i < search_threads; i++)
+    nodes += atomic_load_explicit(&search_thread_data[i].nodes, memory_order_relaxed);
+
+  return nodes;
+}
+
+static int elapsedMs() { return (wallTime() - search_start) * 1000; }
+
+static void checkLimits()
+{
+  if (search_hard_limit != 0 && elapsedMs() >= search_hard_limit)
+    atomic_store(&search_stop, 1);
+  if (search_limits.nodes != 0 && totalNodes() >= search_limits.nodes)
+    atomic_store(&search_stop, 1);
+}
+
+// Counts a node, the main thread also checks the limits every few nodes
+static void visitNode(SearchThread *t)
+{
+  unsigned long long nodes = atomic_load_explicit(&t->nodes, memory_order_relaxed) + 1;
+  atomic_store_explicit(&t->nodes, nodes, memory_order_relaxed);
+
+  if (t->id == 0 && nodes % LIMITS_CHECK_INTERVAL == 0) checkLimits();
+}
+
+void StopSearch() { atomic_store(&search_stop, 1); }
+
+// Called before the search thread is started, so a stop sent right after go isn't lost
+void ResetSearchStop() { atomic_store(&search_stop, 0); }
+
+// Quiescence reaches the same positions through different capture orders, so the static
+// evaluation is looked up in the thread's cache before it's computed
+static int evaluate(SearchThread *t)
+{
+  Board          *b     = &t->board;
+  EvalCacheEntry *entry = &t->eval_cache[b->hash_value & (EVAL_CACHE_SIZE - 1)];
+  unsigned int    key   = b->hash_value >> 32;
+
+  if (entry->key != key)
+  {
+    entry->key  = key;
+    entry->eval = Evaluate(b, &t->pawn_table);
+  }
+
+  return entry->eval;
+}
+
+static int quiesce(SearchThread *t, int alpha, int beta)
+{
+  Board *b = &t->board;
+
+  visitNode(t);
+  if (atomic_load_explicit(&search_stop, memory_order_relaxed)) return 0;
+
+  int static_eval = evaluate(t);
+
+  // The undo stack can't take another move
+  if (b->undo->count >= MAX_PLY - 1) return static_eval;
 
   if (static_eval > alpha) alpha = static_eval;
   if (alpha >= beta) return beta;
 
-  Move moves[MAX_MOVES];
-  int  moves_count;
+  MovePicker mp;
+  Move       move;
 
-  Generate(b, b->turn, GEN_ATTACKS, moves, &moves_count);
+  initCapturePicker(&mp);
 
-  for (int i = 0; i < moves_count; i++)
+  while ((move = nextMove(&mp, b)) != NULL_MOVE)
   {
-    orderMoves(moves, moves_count, NULL_MOVE, NULL_MOVE, i);
-
-    if (IsLegal(b, moves[i]))
-    {
-      MakeMove(b, moves[i]);
-      int score = -quiesce(b, -beta, -alpha);
-      UnmakeMove(b);
+    MakeMove(b, move);
+    int score = -quiesce(t, -beta, -alpha);
+    UnmakeMove(b);
 
-      if (score >= alpha) alpha = score;
-      if (alpha >= beta) return beta;
-    }
+    if (score >= alpha) alpha = score;
+    if (alpha >= beta) return beta;
   }
 
   return alpha;
 }
 
 static int alphaBeta(
-    Board *b, int alpha, int beta, int depthleft, Variation *pv, Variation *previous_pv,
-    int can_null
+    SearchThread *t, int alpha, int beta, int depthleft, Variation *pv, int can_null
 )
 {
+  Board     *b           = &t->board;
+  Variation *previous_pv = &t->previous_pv;
+
+  if (atomic_load_explicit(&search_stop, memory_order_relaxed)) return 0;
+
   int original_alpha = alpha;
 
   Variation child_pv;
   child_pv.plies_count = 0;
 
+  // Check extensions don't bound the search depth, so stop before the undo stack overflows
+  if (b->undo->count >= MAX_PLY - 1)
+  {
+    pv->plies_count = 0;
+    return evaluate(t);
+  }
+
   if (depthleft == 0)
   {
     pv->plies_count = 0;
-    return quiesce(b, alpha, beta);
+    return quiesce(t, alpha, beta);
   }
 
-  Move moves[MAX_MOVES];
-  int  moves_count;
+  visitNode(t);
 
-  Move best_move;
+  Move best_move = NULL_MOVE;
 
   // Read from tt
-  TTEntry *ttEntry = tt + (b->hash_value % TT_SIZE);
+  TTEntry tt_entry;
+  int     tt_hit = ttProbe(b->hash_value, &tt_entry);
 
-  if (ttEntry->occupied == 1 && ttEntry->hash == b->hash_value)
+  // No cutoffs at the root, it has to return a move
+  if (tt_hit && tt_entry.depth >= depthleft && b->undo->count > 0)
   {
-    if (ttEntry->depth >= depthleft)
+    switch (tt_entry.flags & 3)
     {
-      switch (ttEntry->entry_type)
-      {
-        case TTENTRY_EXACT:
-          return ttEntry->score;
-          break;
-        case TTENTRY_LOWERBOUND:
-          if (ttEntry->score < beta) beta = ttEntry->score;
-          break;
-        case TTENTRY_UPPERBOUND:
-          if (ttEntry->score > alpha) alpha = ttEntry->score;
-          break;
-      }
+      case TTENTRY_EXACT:
+        pv->plies_count = 0;
+        return tt_entry.score;
+      case TTENTRY_LOWERBOUND:
+        if (tt_entry.score > alpha) alpha = tt_entry.score;
+        break;
+      case TTENTRY_UPPERBOUND:
+        if (tt_entry.score < beta) beta = tt_entry.score;
+        break;
+    }
 
-      if (alpha > beta) return ttEntry->score;
+    if (alpha >= beta)
+    {
+      pv->plies_count = 0;
+      return tt_entry.score;
     }
-    moves_count = ttEntry->moves_count;
-    for (int i = 0; i < moves_count; i++) moves[i] = ttEntry->moves[i];
-    best_move = tt->best_move;
-  }
-  else
-  {
-    Generate(b, b->turn, GEN_ALL, moves, &moves_count);
-    best_move = NULL_MOVE;
   }
 
   int in_check = IsKingAttacked(b, b->turn);
@@ -201,10 +773,12 @@ static int alphaBeta(
   {
     MakeMove(b, NULL_MOVE);
 
-    int null_move_score = -alphaBeta(b, -beta, 1 - beta, depthleft - 4, &child_pv, previous_pv, 0);
+    int null_move_score = -alphaBeta(t, -beta, 1 - beta, depthleft - 4, &child_pv, 0);
 
     UnmakeMove(b);
 
+    if (atomic_load_explicit(&search_stop, memory_order_relaxed)) return 0;
+
     if (null_move_score >= beta) return beta;
   }
 
@@ -216,49 +790,86 @@ static int alphaBeta(
   // Check extension
   if (in_check) depthleft++;
 
-  for (int i = 0; i < moves_count; i++)
+  // The tt move may come from a different position with the same key, it's verified first
+  Move pv_move = NULL_MOVE;
+  Move tt_move = tt_hit ? unpackMove(b, tt_entry.move) : NULL_MOVE;
+
+  if (b->undo->count < previous_pv->plies_count && isPv(previous_pv, b->undo))
+    pv_move = previous_pv->plies[b->undo->count];
+  if (pv_move != NULL_MOVE && !IsValidMove(b, pv_move)) pv_move = NULL_MOVE;
+  if (tt_move != NULL_MOVE && tt_move != pv_move && !IsValidMove(b, tt_move)) tt_move = NULL_MOVE;
+
+  int  ply          = b->undo->count;
+  Move previous     = ply > 0 ? b->undo->records[ply - 1].move : NULL_MOVE;
+  Move counter_move = NULL_MOVE;
+  if (previous != NULL_MOVE)
+    counter_move = t->counter_moves[GET_ORIGIN_SQ(previous)][GET_DEST_SQ(previous)];
+
+  MovePicker mp;
+  Move       move;
+
+  initMovePicker(&mp, pv_move, tt_move, t->killers[ply], counter_move, t->history[b->turn]);
+
+  Move quiets_tried[MAX_MOVES];
+  int  quiets_tried_count = 0;
+
+  while ((move = nextMove(&mp, b)) != NULL_MOVE)
   {
-    Move pv_move = NULL_MOVE;
-    if (isPv(previous_pv, &b->variation)) pv_move = previous_pv->plies[b->variation.plies_count];
-    orderMoves(moves, moves_count, pv_move, best_move, i);
+    legal_found++;
 
-    if (IsLegal(b, moves[i]))
+    MakeMove(b, move);
+
+    // Late move reduction
+    if (depthleft >= 3 && GET_TYPE(move) == MOVE_TYPE_SILENT && !reduced &&
+        !any_child_failed_high && legal_found > 4)
     {
-      legal_found++;
+      reduced = 1;
+      depthleft--;
+    }
 
-      MakeMove(b, moves[i]);
+    // Principal variation search: the first move is searched with the full window, the rest only
+    // have to be proven worse with a null window and are searched again if that fails
+    int score;
+    if (legal_found == 1)
+      score = -alphaBeta(t, -beta, -alpha, depthleft - 1, &child_pv, can_null);
+    else
+    {
+      score = -alphaBeta(t, -alpha - 1, -alpha, depthleft - 1, &child_pv, can_null);
+      if (score > alpha && score < beta)
+        score = -alphaBeta(t, -beta, -alpha, depthleft - 1, &child_pv, can_null);
+    }
 
-      // Late move reduction
-      if (depthleft >= 3 && GET_TYPE(moves[i]) == MOVE_TYPE_SILENT && !reduced &&
-          !any_child_failed_high && legal_found > 4)
-      {
-        reduced = 1;
-        depthleft--;
-      }
+    if (score == beta) any_child_failed_high = 1;
 
-      int score = -alphaBeta(b, -beta, -alpha, depthleft - 1, &child_pv, previous_pv, can_null);
+    UnmakeMove(b);
 
-      if (score == beta) any_child_failed_high = 1;
+    // The scores of an aborted search can't be trusted, nothing is stored
+    if (atomic_load_explicit(&search_stop, memory_order_relaxed)) return 0;
 
-      UnmakeMove(b);
+    if (score > alpha)
+    {
+      best_move = move;
+      alpha     = score;
 
-      if (score > alpha)
-      {
-        best_move = moves[i];
-        alpha     = score;
+      pv->plies_count = child_pv.plies_count + 1;
+      pv->plies[0]    = move;
+      for (int i = 0; i < child_pv.plies_count; i++) pv->plies[i + 1] = child_pv.plies[i];
+    }
+    if (alpha >= beta)
+    {
+      if (isQuiet(move)) updateQuietOrdering(t, move, quiets_tried, quiets_tried_count, depthleft);
 
-        pv->plies_count = child_pv.plies_count + 1;
-        pv->plies[0]    = moves[i];
-        for (int i = 0; i < child_pv.plies_count; i++) pv->plies[i + 1] = child_pv.plies[i];
-      }
-      if (alpha >= beta) return beta;
+      alpha = beta;
+      break;
     }
+
+    if (isQuiet(move)) quiets_tried[quiets_tried_count++] = move;
   }
 
   if (legal_found == 0)
   {
     if (IsKingAttacked(b, b->turn))
-      alpha = -MATE_SCORE + b->variation.plies_count;
+      alpha = -MATE_SCORE + b->undo->count;
     else
       alpha = 0;
 
@@ -266,59 +877,224 @@ static int alphaBeta(
   }
 
   // Save to tt
-  ttEntry->occupied    = 0;
-  ttEntry->depth       = depthleft;
-  ttEntry->hash        = b->hash_value;
-  ttEntry->moves_count = moves_count;
-  ttEntry->score       = alpha;
+  int entry_type;
   if (alpha <= original_alpha)
-    ttEntry->entry_type = TTENTRY_UPPERBOUND;
+  {
+    entry_type = TTENTRY_UPPERBOUND;
+    best_move  = NULL_MOVE;
+  }
   else if (alpha >= beta)
-    ttEntry->entry_type = TTENTRY_LOWERBOUND;
+    entry_type = TTENTRY_LOWERBOUND;
   else
-    ttEntry->entry_type = TTENTRY_EXACT;
-  for (int i = 0; i < moves_count; i++) ttEntry->moves[i] = moves[i];
-  ttEntry->best_move = best_move;
-  ttEntry->occupied  = 1;
+    entry_type = TTENTRY_EXACT;
+  ttStore(b->hash_value, best_move, alpha, depthleft, entry_type);
 
   return alpha;
 }
 
-Move Search(Board *b)
+// The soft limit is the expected share of the remaining time for this move, it can be exceeded
+// when the best move is unstable. The hard limit guards against losing on time.
+static void initTimeManagement(int side)
 {
-  memset(tt, 0, TT_SIZE * sizeof(TTEntry));
+  search_soft_limit = 0;
+  search_hard_limit = 0;
+
+  if (search_limits.movetime != 0)
+  {
+    search_hard_limit = search_limits.movetime;
+    return;
+  }
+  if (search_limits.time[side] == 0) return;
+
+  int time_left = search_limits.time[side] - MOVE_OVERHEAD;
+  if (time_left < 1) time_left = 1;
 
-  Variation previous_pv;
-  previous_pv.plies_count = 0;
+  int movestogo = search_limits.movestogo != 0 ? search_limits.movestogo : DEFAULT_MOVESTOGO;
 
-  for (int depth = 2; depth < 20; depth++)
+  double soft = (double)time_left / movestogo + search_limits.inc[side] * 3 / 4;
+  if (soft > time_left * 0.6) soft = time_left * 0.6;
+
+  double hard = soft * 4;
+  if (hard > time_left * 0.8) hard = time_left * 0.8;
+
+  search_soft_limit = soft < 1 ? 1 : soft;
+  search_hard_limit = hard < 1 ? 1 : hard;
+}
+
+static void printInfo(SearchThread *t)
+{
+  int                elapsed = elapsedMs();
+  unsigned long long nodes   = totalNodes();
+
+  printf("info depth %d ", t->depth);
+
+  if (IS_WIN_MATE(t->score))
+    printf("score mate %d ", (MATE_SCORE - t->score + 1) / 2);
+  else if (IS_LOSE_MATE(t->score))
+    printf("score mate %d ", -(MATE_SCORE + t->score) / 2);
+  else
+    printf("score cp %d ", t->score);
+
+  printf(
+      "nodes %llu nps %llu time %d pv",
+      nodes,
+      elapsed > 0 ? nodes * 1000 / elapsed : nodes,
+      elapsed
+  );
+  printVariation(&t->pv, t->board.turn);
+  putchar('\n');
+}
+
+// Iterative deepening of a single thread. Helper threads search every other iteration one ply
+// deeper, so they fill the shared tt with entries the main thread needs next.
+static void iterativeDeepening(SearchThread *t)
+{
+  int max_depth = search_limits.depth != 0 ? search_limits.depth + 1 : MAX_DEPTH;
+  if (max_depth > MAX_DEPTH) max_depth = MAX_DEPTH;
+
+  t->previous_pv.plies_count = 0;
+
+  int stability = 0;
+
+  for (int depth = 1; depth < max_depth; depth++)
   {
+    int search_depth = depth + (t->id & 1);
+
     Variation pv;
+    int       score;
+
+    // Aspiration window around the previous score, widened on the failing side until the score
+    // falls inside. Mate scores are searched with the full window.
+    int delta = ASPIRATION_WINDOW;
+    int alpha = -MAX_SCORE;
+    int beta  = MAX_SCORE;
+    if (depth > 2 && !IS_WIN_MATE(t->score) && !IS_LOSE_MATE(t->score))
+    {
+      alpha = t->score - delta;
+      beta  = t->score + delta;
+    }
 
-    Move m     = 0;
-    int  score = alphaBeta(b, -MAX_SCORE, MAX_SCORE, depth, &pv, &previous_pv, 1);
+    for (;;)
+    {
+      score = alphaBeta(t, alpha, beta, search_depth, &pv, 1);
 
-    m = pv.plies[0];
+      if (atomic_load_explicit(&search_stop, memory_order_relaxed)) break;
 
-    char buff[6];
-    PrintMoveStr(buff, m);
-    printf("Best at depth %d: %s, (score: %d)\n", depth, buff, score);
+      if (score <= alpha && alpha != -MAX_SCORE)
+        alpha = score - delta >= -MIN_MATE_SCORE ? score - delta : -MAX_SCORE;
+      else if (score >= beta && beta != MAX_SCORE)
+        beta = score + delta <= MIN_MATE_SCORE ? score + delta : MAX_SCORE;
+      else
+        break;
 
-    printf("PV: ");
-    printVariation(&pv);
-    putchar('\n');
+      delta *= 2;
+    }
 
-    if (IS_LOSE_MATE(score))
+    if (atomic_load_explicit(&search_stop, memory_order_relaxed)) break;
+
+    if (t->pv.plies_count > 0 && pv.plies[0] == t->pv.plies[0])
     {
-      printf("Mate in %d\n", -(pv.plies_count + 1) / 2);
-      break;
+      if (stability < MAX_STABILITY) stability++;
     }
-    if (IS_WIN_MATE(score))
-    {
-      printf("Mate in %d\n", (pv.plies_count + 1) / 2);
+    else
+      stability = 0;
+
+    t->pv          = pv;
+    t->previous_pv = pv;
+    t->score       = score;
+    t->depth       = search_depth;
+
+    if (t->id != 0) continue;
+
+    printInfo(t);
+
+    // A shorter mate can't be found by searching deeper
+    if (IS_LOSE_MATE(score) || IS_WIN_MATE(score)) break;
+
+    if (search_soft_limit != 0 && elapsedMs() >= search_soft_limit * stability_scale[stability])
       break;
-    }
   }
+}
 
-  return 0;
+static void *searchWorker(void *arg)
+{
+  iterativeDeepening(arg);
+  return NULL;
+}
+
+void SetThreads(int threads)
+{
+  if (threads < 1) threads = 1;
+  if (threads > MAX_SEARCH_THREADS) threads = MAX_SEARCH_THREADS;
+
+  search_threads = threads;
+}
+
+// Lazy SMP: all threads search the same root on their own board copy and share only the tt.
+// The main thread's result is reported, the helpers are stopped when it finishes.
+// Limits may be NULL for a search limited only by depth.
+Move Search(Board *b, SearchLimits *limits)
+{
+  search_start = wallTime();
+
+  if (tt == NULL) SetHashSize(TT_DEFAULT_SIZE_MB);
+
+  // Entries from previous searches are kept, but are replaced first
+  tt_age = (tt_age + 1) & TT_AGE_MASK;
+
+  if (limits != NULL)
+    search_limits = *limits;
+  else
+    memset(&search_limits, 0, sizeof(SearchLimits));
+
+  initTimeManagement(b->turn);
+
+  // Move ordering tables start empty for every search
+  SearchThread *threads = calloc(search_threads, sizeof(SearchThread));
+  pthread_t     handles[MAX_SEARCH_THREADS];
+
+  search_thread_data = threads;
+
+  for (int i = 0; i < search_threads; i++)
+  {
+    threads[i].id             = i;
+    threads[i].pv.plies_count = 0;
+    threads[i].depth          = 0;
+    atomic_init(&threads[i].nodes, 0);
+    memcpy(&threads[i].board, b, sizeof(Board));
+    SetUndoStack(&threads[i].board, &threads[i].undo);
+    // The network may have been loaded after the position was set up
+    NNUERefresh(&threads[i].board);
+  }
+
+  for (int i = 1; i < search_threads; i++)
+    pthread_create(&handles[i], NULL, searchWorker, &threads[i]);
+
+  iterativeDeepening(&threads[0]);
+
+  // In infinite mode the result is reported only after a stop command
+  while (search_limits.infinite && !atomic_load(&search_stop))
+  {
+    struct timespec ts = {0, 1000000};
+    nanosleep(&ts, NULL);
+  }
+
+  atomic_store(&search_stop, 1);
+  for (int i = 1; i < search_threads; i++) pthread_join(handles[i], NULL);
+
+  Move best = threads[0].pv.plies_count > 0 ? threads[0].pv.plies[0] : NULL_MOVE;
+
+  // Stopped before the first iteration finished, any legal move is better than none
+  if (best == NULL_MOVE)
+  {
+    Move moves[MAX_MOVES];
+    int  moves_count;
+
+    Generate(b, b->turn, GEN_ALL | GEN_LEGAL, moves, &moves_count);
+    if (moves_count > 0) best = moves[0];
+  }
+
+  free(threads);
+
+  return best;
 }
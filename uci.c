@@ -0,0 +1,210 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+
+#define UCI_BUFF_SIZE 8192
+
+static Board        board;
+static UndoStack    board_undo;
+static Board        search_board;
+static SearchLimits limits;
+
+static pthread_t search_thread;
+static int       searching = 0;
+
+static void *searchThread(void *arg)
+{
+  char buff[6];
+
+  Move best = Search(&search_board, &limits);
+
+  PrintMoveUCI(buff, best, search_board.turn);
+  printf("bestmove %s\n", buff);
+
+  return NULL;
+}
+
+static void stopSearch()
+{
+  if (!searching) return;
+
+  StopSearch();
+  pthread_join(search_thread, NULL);
+  searching = 0;
+}
+
+static Move parseMove(Board *b, char *str)
+{
+  Move moves[MAX_MOVES];
+  int  moves_count;
+
+  Generate(b, b->turn, GEN_ALL | GEN_LEGAL, moves, &moves_count);
+
+  for (int i = 0; i < moves_count; i++)
+  {
+    char buff[6];
+    PrintMoveUCI(buff, moves[i], b->turn);
+    if (strcmp(buff, str) == 0) return moves[i];
+  }
+
+  return NULL_MOVE;
+}
+
+// position [startpos | fen <fen>] [moves <move>...]
+static void position(char *args)
+{
+  char *moves = strstr(args, "moves");
+  if (moves != NULL) *(moves - 1) = '\0';
+
+  if (strncmp(args, "fen ", 4) == 0)
+    FEN(&board, args + 4);
+  else
+    Startpos(&board);
+
+  SetUndoStack(&board, &board_undo);
+
+  if (moves == NULL) return;
+
+  char *move = strtok(moves + strlen("moves"), " \n");
+  while (move != NULL)
+  {
+    Move m = parseMove(&board, move);
+    if (m == NULL_MOVE)
+    {
+      printf("info string illegal move %s\n", move);
+      break;
+    }
+    MakeMove(&board, m);
+
+    // Game moves are never unmade, the search starts counting plies from the current position
+    board_undo.count = 0;
+
+    move = strtok(NULL, " \n");
+  }
+}
+
+static void go(char *args)
+{
+  memset(&limits, 0, sizeof(SearchLimits));
+
+  char *token = strtok(args, " \n");
+  while (token != NULL)
+  {
+    char *value = strtok(NULL, " \n");
+
+    if (strcmp(token, "infinite") == 0)
+    {
+      limits.infinite = 1;
+      token           = value;
+      continue;
+    }
+    if (value == NULL) break;
+
+    if (strcmp(token, "depth") == 0)
+      limits.depth = atoi(value);
+    else if (strcmp(token, "nodes") == 0)
+      limits.nodes = strtoull(value, NULL, 10);
+    else if (strcmp(token, "movetime") == 0)
+      limits.movetime = atoi(value);
+    else if (strcmp(token, "wtime") == 0)
+      limits.time[WHITE] = atoi(value);
+    else if (strcmp(token, "btime") == 0)
+      limits.time[BLACK] = atoi(value);
+    else if (strcmp(token, "winc") == 0)
+      limits.inc[WHITE] = atoi(value);
+    else if (strcmp(token, "binc") == 0)
+      limits.inc[BLACK] = atoi(value);
+    else if (strcmp(token, "movestogo") == 0)
+      limits.movestogo = atoi(value);
+
+    token = strtok(NULL, " \n");
+  }
+
+  memcpy(&search_board, &board, sizeof(Board));
+
+  ResetSearchStop();
+
+  searching = 1;
+  pthread_create(&search_thread, NULL, searchThread, NULL);
+}
+
+// setoption name <name> value <value>
+static void setOption(char *args)
+{
+  char *name  = strstr(args, "name ");
+  char *value = strstr(args, "value ");
+
+  if (name == NULL || value == NULL) return;
+
+  name += strlen("name ");
+  value += strlen("value ");
+
+  if (strncmp(name, "Hash", 4) == 0)
+    SetHashSize(atoi(value));
+  else if (strncmp(name, "Threads", 7) == 0)
+    SetThreads(atoi(value));
+  else if (strncmp(name, "EvalFile", 8) == 0)
+  {
+    // Without a network the classical evaluation is used
+    if (strcmp(value, "<empty>") == 0)
+      nnue_loaded = 0;
+    else if (NNUELoad(value))
+      printf("info string loaded network %s\n", value);
+  }
+}
+
+// Reads commands until quit, the search runs on its own thread so stop is handled immediately
+void UCILoop()
+{
+  char line[UCI_BUFF_SIZE];
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  Startpos(&board);
+
+  while (fgets(line, sizeof(line), stdin) != NULL)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (strcmp(line, "uci") == 0)
+    {
+      printf("id name BattleBishop\n");
+      printf("id author jszczerbinsky\n");
+      printf("option name Hash type spin default 16 min 1 max 65536\n");
+      printf("option name Threads type spin default 1 min 1 max 256\n");
+      printf("option name EvalFile type string default <empty>\n");
+      printf("uciok\n");
+    }
+    else if (strcmp(line, "isready") == 0)
+      printf("readyok\n");
+    else if (strncmp(line, "setoption ", 10) == 0)
+    {
+      stopSearch();
+      setOption(line + 10);
+    }
+    else if (strcmp(line, "ucinewgame") == 0)
+    {
+      stopSearch();
+      ClearHash();
+    }
+    else if (strncmp(line, "position ", 9) == 0)
+    {
+      stopSearch();
+      position(line + 9);
+    }
+    else if (strncmp(line, "go", 2) == 0)
+    {
+      stopSearch();
+      go(line + 2);
+    }
+    else if (strcmp(line, "stop") == 0)
+      stopSearch();
+    else if (strcmp(line, "quit") == 0)
+      break;
+  }
+
+  stopSearch();
+}